@@ -4,11 +4,21 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <type_traits>
+#include <variant>
 
 namespace ASTImpl {
 
@@ -67,17 +77,37 @@ namespace ASTImpl {
         /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
+    namespace {
+        class BinaryOpExpr;
+    }  // namespace
+
+    // Nodes live in the arena of their tree and are never destroyed one by one.
     class Expr {
     public:
-        virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const SheetInterface& sheet) const = 0;
+        // positions in the tree are relative to `anchor`, see FormulaAST
+        virtual void Print(std::ostream& out, Position anchor) const = 0;
+        virtual void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence precedence) const = 0;
+        // returns the value or the first error met in left-to-right order
+        virtual FormulaAST::Value Evaluate(const SheetInterface& sheet, Position anchor) const = 0;
+        // appends the postfix instructions computing this expression; the
+        // positions stay relative
+        virtual void Compile(std::vector<Instruction>& program) const = 0;
+        // appends the subtree in prefix order with absolute positions, see TreeLoader
+        virtual void Save(std::string& out, Position anchor) const = 0;
+
+        // the range when the expression is a range argument of a function
+        virtual const Range* GetRange() const {
+            return nullptr;
+        }
+
+        virtual const BinaryOpExpr* GetBinaryOp() const {
+            return nullptr;
+        }
 
         // higher is tighter
         virtual ExprPrecedence GetPrecedence() const = 0;
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+        void PrintFormula(std::ostream& out, Position anchor, ExprPrecedence parent_precedence,
             bool right_child = false) const {
             auto precedence = GetPrecedence();
             auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,15 +116,208 @@ namespace ASTImpl {
                 out << '(';
             }
 
-            DoPrintFormula(out, precedence);
+            DoPrintFormula(out, anchor, precedence);
 
             if (parens_needed) {
                 out << ')';
             }
         }
+
+    protected:
+        ~Expr() = default;
     };
 
     namespace {
+        // the tags of nodes of a saved tree; a binary or unary operation is
+        // followed by its type, a function by its id and the number of arguments
+        enum class NodeTag : char {
+            Number = 'n',
+            Cell = 'c',
+            Range = 'r',
+            Function = 'f',
+            Unary = 'u',
+            Binary = 'b',
+        };
+
+        // The tree is printed, compiled and saved recursively, so its height
+        // is limited both when parsing and when loading; the same limit lets
+        // every parsed formula be loaded back. The left spine of binary
+        // operations is walked in a loop (see BinaryOpExpr::LeftSpine) and
+        // counts as one level, so a flat chain like A1+A2+...+An is not
+        // limited in length.
+        constexpr int MAX_HEIGHT = 4096;
+        // The parser recurses on parentheses, unary operations and function
+        // arguments, and does so several calls per level.
+        constexpr int MAX_NESTING = 1000;
+
+        // values are saved in the native byte order
+        template <typename T>
+        void SaveValue(std::string& out, const T& value) {
+            static_assert(std::is_trivially_copyable_v<T>);
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        template <typename T>
+        T LoadValue(std::string_view& in) {
+            static_assert(std::is_trivially_copyable_v<T>);
+            if (in.size() < sizeof(T)) {
+                throw ParsingError("Unexpected end of a saved formula");
+            }
+            T value;
+            std::memcpy(&value, in.data(), sizeof(T));
+            in.remove_prefix(sizeof(T));
+            return value;
+        }
+
+        FormulaAST::Value GetCellNumber(const SheetInterface& sheet, Position pos) {
+            if (!pos.IsValid()) {
+                return FormulaError(FormulaError::Category::Ref);
+            }
+            return sheet.GetNumber(pos);
+        }
+
+        FormulaAST::Value CheckResult(double result) {
+            if (std::isinf(result)) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            return result;
+        }
+
+        constexpr std::string_view FUNCTION_NAMES[] = { "SUM", "MIN", "MAX", "AVERAGE", "COUNT" };
+
+        std::string_view GetFunctionName(Function function) {
+            return FUNCTION_NAMES[static_cast<std::size_t>(function)];
+        }
+
+        Function GetFunctionByName(std::string_view name) {
+            const auto it = std::find(std::begin(FUNCTION_NAMES), std::end(FUNCTION_NAMES), name);
+            if (it == std::end(FUNCTION_NAMES)) {
+                throw ParsingError("Unknown function: " + std::string(name));
+            }
+            return static_cast<Function>(it - std::begin(FUNCTION_NAMES));
+        }
+
+        // The kernels keep several independent partial results, so that the
+        // compiler can vectorize the loops without reordering floating-point
+        // operations on its own.
+        constexpr std::size_t KERNEL_LANES = 4;
+
+        double SumKernel(const double* values, std::size_t count) {
+            double partial[KERNEL_LANES] = {};
+            std::size_t i = 0;
+            for (; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+                for (std::size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+                    partial[lane] += values[i + lane];
+                }
+            }
+            double sum = (partial[0] + partial[1]) + (partial[2] + partial[3]);
+            for (; i < count; ++i) {
+                sum += values[i];
+            }
+            return sum;
+        }
+
+        template <typename Compare>
+        double ExtremumKernel(const double* values, std::size_t count, double init, Compare better) {
+            double partial[KERNEL_LANES] = { init, init, init, init };
+            std::size_t i = 0;
+            for (; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+                for (std::size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+                    const double value = values[i + lane];
+                    partial[lane] = better(value, partial[lane]) ? value : partial[lane];
+                }
+            }
+            double result = init;
+            for (double value : partial) {
+                result = better(value, result) ? value : result;
+            }
+            for (; i < count; ++i) {
+                result = better(values[i], result) ? values[i] : result;
+            }
+            return result;
+        }
+
+        // Accumulates the arguments of an aggregate function. Empty cells of
+        // ranges are skipped; other cells are converted to numbers as for
+        // single references.
+        class Aggregate {
+        public:
+            explicit Aggregate(Function function)
+                : function_(function) {
+            }
+
+            void Add(double value) {
+                AddValues(&value, 1);
+            }
+
+            std::optional<FormulaError> AddRange(const SheetInterface& sheet, const Range& range) {
+                // The sheet copies the values of the range into a contiguous
+                // buffer, which is passed to the kernels. The range is read in
+                // strips of whole rows, so that the buffer stays small.
+                constexpr int STRIP_CELLS = 4096;
+                const int width = range.bottom_right.col - range.top_left.col + 1;
+                const int strip_rows = std::max(1, STRIP_CELLS / width);
+                for (int top = range.top_left.row; top <= range.bottom_right.row; top += strip_rows) {
+                    const Range strip{
+                        { top, range.top_left.col },
+                        { std::min(top + strip_rows - 1, range.bottom_right.row), range.bottom_right.col },
+                    };
+                    values_.clear();
+                    if (auto error = sheet.CollectNumbers(strip, values_)) {
+                        return error;
+                    }
+                    AddValues(values_.data(), values_.size());
+                }
+                return std::nullopt;
+            }
+
+            FormulaAST::Value GetResult() const {
+                switch (function_) {
+                case Function::Sum:
+                    return CheckResult(sum_);
+                case Function::Average:
+                    if (count_ == 0) {
+                        return FormulaError(FormulaError::Category::Div0);
+                    }
+                    return CheckResult(sum_ / static_cast<double>(count_));
+                case Function::Min:
+                    return count_ == 0 ? 0.0 : min_;
+                case Function::Max:
+                    return count_ == 0 ? 0.0 : max_;
+                case Function::Count:
+                    return static_cast<double>(count_);
+                }
+                assert(false);
+                return 0.0;
+            }
+
+        private:
+            void AddValues(const double* values, std::size_t count) {
+                switch (function_) {
+                case Function::Sum:
+                case Function::Average:
+                    sum_ += SumKernel(values, count);
+                    break;
+                case Function::Min:
+                    min_ = std::min(min_, ExtremumKernel(values, count, min_, std::less<>{}));
+                    break;
+                case Function::Max:
+                    max_ = std::max(max_, ExtremumKernel(values, count, max_, std::greater<>{}));
+                    break;
+                case Function::Count:
+                    break;
+                }
+                count_ += count;
+            }
+
+            Function function_;
+            double sum_ = 0.0;
+            double min_ = std::numeric_limits<double>::infinity();
+            double max_ = -std::numeric_limits<double>::infinity();
+            std::size_t count_ = 0;
+            std::vector<double> values_;
+        };
+
         class BinaryOpExpr final : public Expr {
         public:
             enum Type : char {
@@ -105,24 +328,50 @@ namespace ASTImpl {
             };
 
         public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+            explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
                 : type_(type)
-                , lhs_(std::move(lhs))
-                , rhs_(std::move(rhs)) {
+                , lhs_(lhs)
+                , rhs_(rhs) {
             }
 
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
-                out << ' ';
-                rhs_->Print(out);
-                out << ')';
+            const BinaryOpExpr* GetBinaryOp() const override {
+                return this;
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
-                out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+            void Print(std::ostream& out, Position anchor) const override {
+                const LeftSpine spine(this);
+                for (std::size_t i = spine.size(); i-- > 0;) {
+                    out << '(' << static_cast<char>(spine[i]->type_) << ' ';
+                }
+                spine[0]->lhs_->Print(out, anchor);
+                for (const BinaryOpExpr* node : spine) {
+                    out << ' ';
+                    node->rhs_->Print(out, anchor);
+                    out << ')';
+                }
+            }
+
+            void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence /* precedence */) const override {
+                // the parentheses of this operation are printed by the caller,
+                // those of the inner ones - here
+                const LeftSpine spine(this);
+                auto parens_needed = [&](std::size_t i) {
+                    return i + 1 < spine.size()
+                        && PRECEDENCE_RULES[spine[i + 1]->GetPrecedence()][spine[i]->GetPrecedence()] & PR_LEFT;
+                };
+                for (std::size_t i = spine.size(); i-- > 0;) {
+                    if (parens_needed(i)) {
+                        out << '(';
+                    }
+                }
+                spine[0]->lhs_->PrintFormula(out, anchor, spine[0]->GetPrecedence());
+                for (std::size_t i = 0; i < spine.size(); ++i) {
+                    out << static_cast<char>(spine[i]->type_);
+                    spine[i]->rhs_->PrintFormula(out, anchor, spine[i]->GetPrecedence(), /* right_child = */ true);
+                    if (parens_needed(i)) {
+                        out << ')';
+                    }
+                }
             }
 
             ExprPrecedence GetPrecedence() const override {
@@ -142,9 +391,110 @@ namespace ASTImpl {
                 }
             }
 
-            double Evaluate(const SheetInterface& sheet) const override {
-                auto lhs = lhs_->Evaluate(sheet);
-                auto rhs = rhs_->Evaluate(sheet);
+            FormulaAST::Value Evaluate(const SheetInterface& sheet, Position anchor) const override {
+                const LeftSpine spine(this);
+                auto value = spine[0]->lhs_->Evaluate(sheet, anchor);
+                for (const BinaryOpExpr* node : spine) {
+                    if (!std::holds_alternative<double>(value)) {
+                        return value;
+                    }
+                    const auto rhs_value = node->rhs_->Evaluate(sheet, anchor);
+                    if (!std::holds_alternative<double>(rhs_value)) {
+                        return rhs_value;
+                    }
+                    value = node->Apply(std::get<double>(value), std::get<double>(rhs_value));
+                }
+                return value;
+            }
+
+            void Compile(std::vector<Instruction>& program) const override {
+                const LeftSpine spine(this);
+                spine[0]->lhs_->Compile(program);
+                for (const BinaryOpExpr* node : spine) {
+                    node->rhs_->Compile(program);
+                    Instruction instruction{};
+                    switch (node->type_) {
+                    case Add:
+                        instruction.code = Instruction::OpCode::Add;
+                        break;
+                    case Subtract:
+                        instruction.code = Instruction::OpCode::Subtract;
+                        break;
+                    case Multiply:
+                        instruction.code = Instruction::OpCode::Multiply;
+                        break;
+                    case Divide:
+                        instruction.code = Instruction::OpCode::Divide;
+                        break;
+                    }
+                    program.push_back(instruction);
+                }
+            }
+
+            // Saves the operations of the left spine first, so that TreeLoader
+            // can read them in a loop too.
+            void Save(std::string& out, Position anchor) const override {
+                const LeftSpine spine(this);
+                for (std::size_t i = spine.size(); i-- > 0;) {
+                    SaveValue(out, NodeTag::Binary);
+                    SaveValue(out, spine[i]->type_);
+                }
+                spine[0]->lhs_->Save(out, anchor);
+                for (const BinaryOpExpr* node : spine) {
+                    node->rhs_->Save(out, anchor);
+                }
+            }
+
+        private:
+            Type type_;
+            const Expr* lhs_;
+            const Expr* rhs_;
+
+            // The operations on the left spine of an operation, from the
+            // innermost up to the operation itself. A flat chain like
+            // A1+A2+...+An makes a tree as high as the chain is long, so the
+            // tree is walked along the spine in a loop, and recursion goes only
+            // into the right operands. Short spines are kept on the stack.
+            class LeftSpine {
+            public:
+                explicit LeftSpine(const BinaryOpExpr* root) {
+                    for (const BinaryOpExpr* node = root; node != nullptr; node = node->lhs_->GetBinaryOp()) {
+                        ++size_;
+                    }
+                    if (size_ > inline_nodes_.size()) {
+                        heap_nodes_.resize(size_);
+                        nodes_ = heap_nodes_.data();
+                    }
+                    std::size_t i = size_;
+                    for (const BinaryOpExpr* node = root; node != nullptr; node = node->lhs_->GetBinaryOp()) {
+                        nodes_[--i] = node;
+                    }
+                }
+
+                LeftSpine(const LeftSpine&) = delete;
+                LeftSpine& operator=(const LeftSpine&) = delete;
+
+                const BinaryOpExpr* const* begin() const {
+                    return nodes_;
+                }
+                const BinaryOpExpr* const* end() const {
+                    return nodes_ + size_;
+                }
+                std::size_t size() const {
+                    return size_;
+                }
+                const BinaryOpExpr* operator[](std::size_t i) const {
+                    return nodes_[i];
+                }
+
+            private:
+                std::array<const BinaryOpExpr*, 8> inline_nodes_;
+                std::vector<const BinaryOpExpr*> heap_nodes_;
+                const BinaryOpExpr** nodes_ = inline_nodes_.data();
+                std::size_t size_ = 0;
+            };
+
+            FormulaAST::Value Apply(double lhs, double rhs) const {
                 double result;
                 switch (type_) {
                 case Add:
@@ -161,23 +511,15 @@ namespace ASTImpl {
                         result = lhs / rhs;
                     }
                     else {
-                        throw FormulaError(FormulaError::Category::Div0);
+                        return FormulaError(FormulaError::Category::Div0);
                     }
                     break;
                 default:
                     assert(false);
-                    return static_cast<ExprPrecedence>(INT_MAX);
-                }
-                if (std::isinf(result)) {
-                    throw FormulaError(FormulaError::Category::Div0);
+                    return 0.0;
                 }
-                return result;
+                return CheckResult(result);
             }
-
-        private:
-            Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
         };
 
         class UnaryOpExpr final : public Expr {
@@ -188,99 +530,268 @@ namespace ASTImpl {
             };
 
         public:
-            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+            explicit UnaryOpExpr(Type type, const Expr* operand)
                 : type_(type)
-                , operand_(std::move(operand)) {
+                , operand_(operand) {
             }
 
-            void Print(std::ostream& out) const override {
+            void Print(std::ostream& out, Position anchor) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
+                operand_->Print(out, anchor);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+            void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence precedence) const override {
                 out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
+                operand_->PrintFormula(out, anchor, precedence);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_UNARY;
             }
 
-            double Evaluate(const SheetInterface& sheet) const override {
-                auto result = operand_->Evaluate(sheet);
-                return (type_ == UnaryMinus) ? -result : result;
+            FormulaAST::Value Evaluate(const SheetInterface& sheet, Position anchor) const override {
+                auto result = operand_->Evaluate(sheet, anchor);
+                if (type_ == UnaryMinus && std::holds_alternative<double>(result)) {
+                    return -std::get<double>(result);
+                }
+                return result;
+            }
+
+            void Compile(std::vector<Instruction>& program) const override {
+                operand_->Compile(program);
+                // unary plus does not change the value
+                if (type_ == UnaryMinus) {
+                    Instruction instruction{};
+                    instruction.code = Instruction::OpCode::Negate;
+                    program.push_back(instruction);
+                }
+            }
+
+            void Save(std::string& out, Position anchor) const override {
+                SaveValue(out, NodeTag::Unary);
+                SaveValue(out, type_);
+                operand_->Save(out, anchor);
             }
 
         private:
             Type type_;
-            std::unique_ptr<Expr> operand_;
+            const Expr* operand_;
         };
 
         class CellExpr final : public Expr {
         public:
-            explicit CellExpr(const Position* cell)
+            explicit CellExpr(Position cell)
                 : cell_(cell) {
             }
 
-            void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
+            void Print(std::ostream& out, Position anchor) const override {
+                const Position cell = FormulaAST::ToAbsolute(cell_, anchor);
+                if (!cell.IsValid()) {
                     out << FormulaError::Category::Ref;
                 }
                 else {
-                    out << cell_->ToString();
+                    out << cell.ToString();
                 }
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence /* precedence */) const override {
+                Print(out, anchor);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_ATOM;
             }
 
-            double Evaluate(const SheetInterface& sheet) const override {
-                if (!cell_->IsValid()) {
-                    throw FormulaError::Category::Ref;
-                }
-                const auto& cell = sheet.GetCell(*cell_);
-                if (cell == nullptr) {
-                    return 0.0;
+            FormulaAST::Value Evaluate(const SheetInterface& sheet, Position anchor) const override {
+                return GetCellNumber(sheet, FormulaAST::ToAbsolute(cell_, anchor));
+            }
+
+            void Compile(std::vector<Instruction>& program) const override {
+                Instruction instruction{};
+                instruction.code = Instruction::OpCode::LoadCell;
+                instruction.cell = cell_;
+                program.push_back(instruction);
+            }
+
+            void Save(std::string& out, Position anchor) const override {
+                SaveValue(out, NodeTag::Cell);
+                SaveValue(out, FormulaAST::ToAbsolute(cell_, anchor));
+            }
+
+        private:
+            Position cell_;
+        };
+
+        class RangeExpr final : public Expr {
+        public:
+            explicit RangeExpr(Range range)
+                : range_(range) {
+            }
+
+            void Print(std::ostream& out, Position anchor) const override {
+                out << FormulaAST::ToAbsolute(range_, anchor).ToString();
+            }
+
+            void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence /* precedence */) const override {
+                Print(out, anchor);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            // the grammar only allows ranges as function arguments, which
+            // FunctionExpr handles itself
+            FormulaAST::Value Evaluate(const SheetInterface& /* sheet */, Position /* anchor */) const override {
+                assert(false);
+                return FormulaError(FormulaError::Category::Value);
+            }
+
+            void Compile(std::vector<Instruction>& program) const override {
+                Instruction instruction{};
+                instruction.code = Instruction::OpCode::AccumulateRange;
+                instruction.range = range_;
+                program.push_back(instruction);
+            }
+
+            void Save(std::string& out, Position anchor) const override {
+                SaveValue(out, NodeTag::Range);
+                SaveValue(out, FormulaAST::ToAbsolute(range_, anchor));
+            }
+
+            const Range* GetRange() const override {
+                return &range_;
+            }
+
+        private:
+            Range range_;
+        };
+
+        class FunctionExpr final : public Expr {
+        public:
+            // `args` are in the arena as well
+            FunctionExpr(Function function, const Expr* const* args, std::uint32_t arg_count)
+                : function_(function)
+                , arg_count_(arg_count)
+                , args_(args) {
+            }
+
+            void Print(std::ostream& out, Position anchor) const override {
+                out << '(' << GetFunctionName(function_);
+                for (const Expr* arg : GetArgs()) {
+                    out << ' ';
+                    arg->Print(out, anchor);
                 }
-                const auto& value = cell->GetValue();
-                if (std::holds_alternative<double>(value)) {
-                    return std::get<double>(value);
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, Position anchor, ExprPrecedence /* precedence */) const override {
+                out << GetFunctionName(function_) << '(';
+                bool first = true;
+                for (const Expr* arg : GetArgs()) {
+                    if (!first) {
+                        out << ',';
+                    }
+                    first = false;
+                    arg->PrintFormula(out, anchor, EP_ATOM);
                 }
-                if (std::holds_alternative<std::string>(value)) {
-                    if (std::get<std::string>(value).empty()) {
-                        return 0.0;
+                out << ')';
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            FormulaAST::Value Evaluate(const SheetInterface& sheet, Position anchor) const override {
+                Aggregate aggregate(function_);
+                for (const Expr* arg : GetArgs()) {
+                    if (const Range* range = arg->GetRange()) {
+                        if (auto error = aggregate.AddRange(sheet, FormulaAST::ToAbsolute(*range, anchor))) {
+                            return *error;
+                        }
+                        continue;
                     }
-                    char* c;
-                    double number = std::strtod(std::get<std::string>(value).c_str(), &c);
-                    if (*c == '\0') {
-                        return number;
+                    const auto value = arg->Evaluate(sheet, anchor);
+                    if (!std::holds_alternative<double>(value)) {
+                        return value;
                     }
+                    aggregate.Add(std::get<double>(value));
+                }
+                return aggregate.GetResult();
+            }
+
+            void Compile(std::vector<Instruction>& program) const override {
+                Instruction begin{};
+                begin.code = Instruction::OpCode::BeginAggregate;
+                begin.function = function_;
+                program.push_back(begin);
+                for (const Expr* arg : GetArgs()) {
+                    arg->Compile(program);
+                    if (!arg->GetRange()) {
+                        Instruction accumulate{};
+                        accumulate.code = Instruction::OpCode::AccumulateValue;
+                        program.push_back(accumulate);
+                    }
+                }
+                Instruction end{};
+                end.code = Instruction::OpCode::EndAggregate;
+                end.function = function_;
+                program.push_back(end);
+            }
+
+            void Save(std::string& out, Position anchor) const override {
+                SaveValue(out, NodeTag::Function);
+                SaveValue(out, function_);
+                SaveValue(out, arg_count_);
+                for (const Expr* arg : GetArgs()) {
+                    arg->Save(out, anchor);
                 }
-                throw FormulaError(FormulaError::Category::Value);
             }
 
         private:
-            const Position* cell_;
+            struct Args {
+                const Expr* const* first;
+                const Expr* const* last;
+
+                const Expr* const* begin() const {
+                    return first;
+                }
+                const Expr* const* end() const {
+                    return last;
+                }
+            };
+
+            Args GetArgs() const {
+                return { args_, args_ + arg_count_ };
+            }
+
+            Function function_;
+            std::uint32_t arg_count_;
+            const Expr* const* args_;
         };
 
+        // Moves the last `arg_count` nodes of `stack` into the arena as the
+        // arguments of a new function node.
+        const Expr* MakeFunction(Arena& arena, Function function, std::vector<const Expr*>& stack,
+            std::size_t arg_count) {
+            assert(stack.size() >= arg_count);
+            const auto args = arena.MakeArray(stack.data() + stack.size() - arg_count, arg_count);
+            stack.resize(stack.size() - arg_count);
+            return arena.Make<FunctionExpr>(function, args, static_cast<std::uint32_t>(arg_count));
+        }
+
         class NumberExpr final : public Expr {
         public:
             explicit NumberExpr(double value)
                 : value_(value) {
             }
 
-            void Print(std::ostream& out) const override {
+            void Print(std::ostream& out, Position /* anchor */) const override {
                 out << value_;
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+            void DoPrintFormula(std::ostream& out, Position /* anchor */, ExprPrecedence /* precedence */) const override {
                 out << value_;
             }
 
@@ -288,33 +799,308 @@ namespace ASTImpl {
                 return EP_ATOM;
             }
 
-            double Evaluate(const SheetInterface& sheet) const override {
+            FormulaAST::Value Evaluate(const SheetInterface& /* sheet */, Position /* anchor */) const override {
                 return value_;
             }
 
+            void Compile(std::vector<Instruction>& program) const override {
+                Instruction instruction{};
+                instruction.code = Instruction::OpCode::PushNumber;
+                instruction.number = value_;
+                program.push_back(instruction);
+            }
+
+            void Save(std::string& out, Position /* anchor */) const override {
+                SaveValue(out, NodeTag::Number);
+                SaveValue(out, value_);
+            }
+
         private:
             double value_;
         };
 
+        bool IsNumber(const Instruction& instruction) {
+            return instruction.code == Instruction::OpCode::PushNumber;
+        }
+
+        Instruction::OpCode WithNumberOperand(Instruction::OpCode code) {
+            switch (code) {
+            case Instruction::OpCode::Add:
+                return Instruction::OpCode::AddNumber;
+            case Instruction::OpCode::Subtract:
+                return Instruction::OpCode::SubtractNumber;
+            case Instruction::OpCode::Multiply:
+                return Instruction::OpCode::MultiplyNumber;
+            default:
+                assert(code == Instruction::OpCode::Divide);
+                return Instruction::OpCode::DivideNumber;
+            }
+        }
+
+        // the result of a binary operation, or nullopt if it is an error
+        std::optional<double> ApplyOperation(Instruction::OpCode code, double lhs, double rhs) {
+            double result;
+            switch (code) {
+            case Instruction::OpCode::Add:
+                result = lhs + rhs;
+                break;
+            case Instruction::OpCode::Subtract:
+                result = lhs - rhs;
+                break;
+            case Instruction::OpCode::Multiply:
+                result = lhs * rhs;
+                break;
+            default:
+                assert(code == Instruction::OpCode::Divide);
+                if (rhs == 0) {
+                    return std::nullopt;
+                }
+                result = lhs / rhs;
+                break;
+            }
+            if (std::isinf(result)) {
+                return std::nullopt;
+            }
+            return result;
+        }
+
+        // The result of the aggregate in [first, last) if all of its arguments
+        // are numbers and it is not an error.
+        std::optional<double> ApplyAggregate(const Instruction* first, const Instruction* last) {
+            assert(first->code == Instruction::OpCode::BeginAggregate);
+            Aggregate aggregate(first->function);
+            for (++first; first != last; first += 2) {
+                if (last - first < 2 || !IsNumber(first[0])
+                    || first[1].code != Instruction::OpCode::AccumulateValue) {
+                    return std::nullopt;
+                }
+                aggregate.Add(first[0].number);
+            }
+            const auto result = aggregate.GetResult();
+            if (!std::holds_alternative<double>(result)) {
+                return std::nullopt;
+            }
+            return std::get<double>(result);
+        }
+
+        // Simplifies a compiled program without changing its results.
+        // Operations and aggregates of constants are computed once, double
+        // negations cancel out, and a constant right operand is fused into its
+        // operation; for addition and multiplication a constant left operand is
+        // moved to the right first, which is exact and cannot change which
+        // error comes first. Constant subexpressions that end in an error are
+        // kept, so that Execute reports the error in the same place as before.
+        void FoldConstants(std::vector<Instruction>& program) {
+            using OpCode = Instruction::OpCode;
+
+            std::vector<Instruction> folded;
+            folded.reserve(program.size());
+            // the index in `folded` where each value on the evaluation stack
+            // starts to be computed
+            std::vector<std::size_t> value_starts;
+            // the same for the aggregates being accumulated
+            std::vector<std::size_t> aggregate_starts;
+            for (const Instruction& instruction : program) {
+                switch (instruction.code) {
+                case OpCode::PushNumber:
+                case OpCode::LoadCell:
+                    value_starts.push_back(folded.size());
+                    break;
+                case OpCode::Negate:
+                    // the operand is computed by the last instruction
+                    if (IsNumber(folded.back())) {
+                        folded.back().number = -folded.back().number;
+                        continue;
+                    }
+                    if (folded.back().code == OpCode::Negate) {
+                        folded.pop_back();
+                        continue;
+                    }
+                    break;
+                case OpCode::BeginAggregate:
+                    aggregate_starts.push_back(folded.size());
+                    break;
+                case OpCode::AccumulateValue:
+                    value_starts.pop_back();
+                    break;
+                case OpCode::AccumulateRange:
+                    break;
+                case OpCode::EndAggregate: {
+                    const std::size_t start = aggregate_starts.back();
+                    aggregate_starts.pop_back();
+                    value_starts.push_back(start);
+                    if (const auto result = ApplyAggregate(folded.data() + start, folded.data() + folded.size())) {
+                        folded.erase(folded.begin() + start + 1, folded.end());
+                        folded.back() = Instruction{};
+                        folded.back().code = OpCode::PushNumber;
+                        folded.back().number = *result;
+                        continue;
+                    }
+                    break;
+                }
+                case OpCode::Add:
+                case OpCode::Subtract:
+                case OpCode::Multiply:
+                case OpCode::Divide: {
+                    const std::size_t rhs_start = value_starts.back();
+                    value_starts.pop_back();
+                    const std::size_t lhs_start = value_starts.back();
+                    const bool number_rhs = rhs_start + 1 == folded.size() && IsNumber(folded[rhs_start]);
+                    const bool number_lhs = lhs_start + 1 == rhs_start && IsNumber(folded[lhs_start]);
+                    if (number_lhs && number_rhs) {
+                        const auto result = ApplyOperation(instruction.code, folded[lhs_start].number,
+                            folded[rhs_start].number);
+                        if (result) {
+                            folded.pop_back();
+                            folded.back().number = *result;
+                            continue;
+                        }
+                    }
+                    else if (number_rhs) {
+                        folded.back().code = WithNumberOperand(instruction.code);
+                        continue;
+                    }
+                    else if (number_lhs
+                        && (instruction.code == OpCode::Add || instruction.code == OpCode::Multiply)) {
+                        Instruction fused = folded[lhs_start];
+                        fused.code = WithNumberOperand(instruction.code);
+                        folded.erase(folded.begin() + lhs_start);
+                        folded.push_back(fused);
+                        continue;
+                    }
+                    break;
+                }
+                default:
+                    assert(false);
+                    break;
+                }
+                folded.push_back(instruction);
+            }
+            program = std::move(folded);
+        }
+
+        // Restores a tree saved by Expr::Save into the arena.
+        class TreeLoader {
+        public:
+            const Expr* LoadNode(std::string_view& in) {
+                if (++depth_ > MAX_HEIGHT) {
+                    throw ParsingError("A saved formula is nested too deeply");
+                }
+                const Expr* node = LoadTaggedNode(in);
+                --depth_;
+                return node;
+            }
+
+            Arena MoveArena() {
+                return std::move(arena_);
+            }
+
+        private:
+            Arena arena_;
+            // arguments of the functions being loaded
+            std::vector<const Expr*> args_;
+            // operations of the left spines being loaded
+            std::vector<BinaryOpExpr::Type> operations_;
+            // the nesting of LoadNode calls, see MAX_HEIGHT
+            int depth_ = 0;
+
+            const Expr* LoadTaggedNode(std::string_view& in) {
+                switch (LoadValue<NodeTag>(in)) {
+                case NodeTag::Number:
+                    return arena_.Make<NumberExpr>(LoadValue<double>(in));
+                case NodeTag::Cell: {
+                    const auto cell = LoadValue<Position>(in);
+                    if (!cell.IsValid()) {
+                        throw ParsingError("Invalid position in a saved formula");
+                    }
+                    return arena_.Make<CellExpr>(cell);
+                }
+                case NodeTag::Range: {
+                    const auto range = LoadValue<Range>(in);
+                    if (!range.IsValid()) {
+                        throw ParsingError("Invalid range in a saved formula");
+                    }
+                    return arena_.Make<RangeExpr>(range);
+                }
+                case NodeTag::Function: {
+                    const auto function = LoadValue<Function>(in);
+                    if (static_cast<std::size_t>(function) >= std::size(FUNCTION_NAMES)) {
+                        throw ParsingError("Unknown function in a saved formula");
+                    }
+                    const auto arg_count = LoadValue<std::uint32_t>(in);
+                    if (arg_count == 0) {
+                        throw ParsingError("A function without arguments in a saved formula");
+                    }
+                    for (std::uint32_t i = 0; i < arg_count; ++i) {
+                        args_.push_back(LoadNode(in));
+                    }
+                    return MakeFunction(arena_, function, args_, arg_count);
+                }
+                case NodeTag::Unary: {
+                    const auto type = LoadValue<UnaryOpExpr::Type>(in);
+                    if (type != UnaryOpExpr::UnaryPlus && type != UnaryOpExpr::UnaryMinus) {
+                        throw ParsingError("Unknown unary operation in a saved formula");
+                    }
+                    const Expr* operand = LoadArgument(in);
+                    return arena_.Make<UnaryOpExpr>(type, operand);
+                }
+                case NodeTag::Binary: {
+                    // the operations of the left spine come first, see
+                    // BinaryOpExpr::Save; the innermost one is read last
+                    const std::size_t spine_start = operations_.size();
+                    operations_.push_back(LoadBinaryType(in));
+                    while (!in.empty() && static_cast<NodeTag>(in.front()) == NodeTag::Binary) {
+                        in.remove_prefix(sizeof(NodeTag));
+                        operations_.push_back(LoadBinaryType(in));
+                    }
+                    const Expr* lhs = LoadArgument(in);
+                    while (operations_.size() > spine_start) {
+                        const auto type = operations_.back();
+                        operations_.pop_back();
+                        const Expr* rhs = LoadArgument(in);
+                        lhs = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+                    }
+                    return lhs;
+                }
+                }
+                throw ParsingError("Unknown node in a saved formula");
+            }
+
+            BinaryOpExpr::Type LoadBinaryType(std::string_view& in) {
+                const auto type = LoadValue<BinaryOpExpr::Type>(in);
+                if (type != BinaryOpExpr::Add && type != BinaryOpExpr::Subtract
+                    && type != BinaryOpExpr::Multiply && type != BinaryOpExpr::Divide) {
+                    throw ParsingError("Unknown binary operation in a saved formula");
+                }
+                return type;
+            }
+
+            // the grammar allows ranges only as arguments of functions
+            const Expr* LoadArgument(std::string_view& in) {
+                const Expr* node = LoadNode(in);
+                if (node->GetRange()) {
+                    throw ParsingError("A range outside of a function in a saved formula");
+                }
+                return node;
+            }
+        };
+
         class ParseASTListener final : public FormulaBaseListener {
         public:
-            std::unique_ptr<Expr> MoveRoot() {
+            const Expr* GetRoot() const {
                 assert(args_.size() == 1);
-                auto root = std::move(args_.front());
-                args_.clear();
-
-                return root;
+                return args_.front();
             }
 
-            std::forward_list<Position> MoveCells() {
-                return std::move(cells_);
+            Arena MoveArena() {
+                return std::move(arena_);
             }
 
         public:
             void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
                 assert(args_.size() >= 1);
 
-                auto operand = std::move(args_.back());
+                const Expr* operand = args_.back();
 
                 UnaryOpExpr::Type type;
                 if (ctx->SUB()) {
@@ -325,8 +1111,7 @@ namespace ASTImpl {
                     type = UnaryOpExpr::UnaryPlus;
                 }
 
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                args_.back() = std::move(node);
+                args_.back() = arena_.Make<UnaryOpExpr>(type, operand);
             }
 
             void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -338,8 +1123,7 @@ namespace ASTImpl {
                     throw ParsingError("Invalid number: " + valueStr);
                 }
 
-                auto node = std::make_unique<NumberExpr>(value);
-                args_.push_back(std::move(node));
+                args_.push_back(arena_.Make<NumberExpr>(value));
             }
 
             void exitCell(FormulaParser::CellContext* ctx) override {
@@ -349,18 +1133,16 @@ namespace ASTImpl {
                     throw FormulaException("Invalid position: " + value_str);
                 }
 
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
-                args_.push_back(std::move(node));
+                args_.push_back(arena_.Make<CellExpr>(value));
             }
 
             void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
                 assert(args_.size() >= 2);
 
-                auto rhs = std::move(args_.back());
+                const Expr* rhs = args_.back();
                 args_.pop_back();
 
-                auto lhs = std::move(args_.back());
+                const Expr* lhs = args_.back();
 
                 BinaryOpExpr::Type type;
                 if (ctx->ADD()) {
@@ -377,8 +1159,25 @@ namespace ASTImpl {
                     type = BinaryOpExpr::Divide;
                 }
 
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                args_.back() = std::move(node);
+                args_.back() = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+            }
+
+            void exitRange(FormulaParser::RangeContext* ctx) override {
+                auto first_str = ctx->CELL(0)->getSymbol()->getText();
+                auto second_str = ctx->CELL(1)->getSymbol()->getText();
+                auto first = Position::FromString(first_str);
+                auto second = Position::FromString(second_str);
+                if (!first.IsValid() || !second.IsValid()) {
+                    throw FormulaException("Invalid range: " + first_str + ':' + second_str);
+                }
+
+                args_.push_back(arena_.Make<RangeExpr>(Range::FromCorners(first, second)));
+            }
+
+            void exitFunction(FormulaParser::FunctionContext* ctx) override {
+                const auto function = GetFunctionByName(ctx->FUNCTION()->getSymbol()->getText());
+                const Expr* node = MakeFunction(arena_, function, args_, ctx->arg().size());
+                args_.push_back(node);
             }
 
             void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -386,8 +1185,405 @@ namespace ASTImpl {
             }
 
         private:
-            std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
+            Arena arena_;
+            std::vector<const Expr*> args_;
+        };
+
+        // Reads the language of Formula.g4 straight from the text into the
+        // AST. The tokens follow the ANTLR lexer (the longest match wins), and
+        // the grammar is parsed by recursive descent, one function per
+        // precedence level; unary operations bind tighter than binary ones.
+        class Parser {
+        public:
+            // positions are stored relative to `anchor`
+            Parser(std::string_view text, Position anchor)
+                : text_(text)
+                , anchor_(anchor)
+                , arena_(EstimateArenaSize(text)) {
+                Next();
+            }
+
+            const Expr* ParseMain() {
+                const Expr* root = ParseExpr();
+                if (token_.kind != Token::End) {
+                    throw ParsingError("Unexpected token: " + std::string(token_.text));
+                }
+                return root;
+            }
+
+            // appends the tokens with cells replaced by their offsets from the
+            // anchor, see AppendFormulaShape
+            void AppendShape(std::string& out) {
+                for (; token_.kind != Token::End; Next()) {
+                    if (token_.kind == Token::Cell) {
+                        const Position offset = ToRelative(ParsePosition(token_.text));
+                        out += '[';
+                        AppendInt(out, offset.row);
+                        out += ',';
+                        AppendInt(out, offset.col);
+                        out += ']';
+                    }
+                    else {
+                        out += token_.text;
+                    }
+                    // separates tokens that would merge into another one
+                    out += ' ';
+                }
+            }
+
+            Arena MoveArena() {
+                return std::move(arena_);
+            }
+
+        private:
+            struct Token {
+                enum Kind {
+                    Number,
+                    Cell,
+                    Function,
+                    Add,
+                    Subtract,
+                    Multiply,
+                    Divide,
+                    LeftParen,
+                    RightParen,
+                    Comma,
+                    Colon,
+                    End,
+                };
+
+                Kind kind = End;
+                std::string_view text;
+            };
+
+            std::string_view text_;
+            Position anchor_;
+            std::size_t pos_ = 0;
+            Token token_;
+            Arena arena_;
+            // arguments of the functions being parsed
+            std::vector<const Expr*> args_;
+            // the depth of the recursive descent and the height of the
+            // subtree parsed last, limited by MAX_NESTING and MAX_HEIGHT
+            int nesting_ = 0;
+            int height_ = 0;
+
+            // An upper bound of the size of the nodes, so that the tree fits
+            // into the first block of the arena. Every node has a token of its
+            // own: a number or a cell (a range has two), an operation, or the
+            // parenthesis after a function name; each argument after the first
+            // one is preceded by a comma.
+            static std::size_t EstimateArenaSize(std::string_view text) {
+                constexpr std::size_t operand_size = std::max(sizeof(NumberExpr), sizeof(CellExpr));
+                static_assert(2 * operand_size >= sizeof(RangeExpr));
+                constexpr std::size_t operation_size = std::max(sizeof(BinaryOpExpr), sizeof(UnaryOpExpr));
+                std::size_t size = 0;
+                bool in_operand = false;
+                for (const char c : text) {
+                    const bool operand_char = IsDigit(c) || IsLetter(c) || c == '.' || c == 'e';
+                    if (operand_char && !in_operand) {
+                        size += operand_size;
+                    }
+                    in_operand = operand_char;
+                    switch (c) {
+                    case '+':
+                    case '-':
+                    case '*':
+                    case '/':
+                        size += operation_size;
+                        break;
+                    case '(':
+                        size += sizeof(FunctionExpr) + sizeof(const Expr*);
+                        break;
+                    case ',':
+                        size += sizeof(const Expr*);
+                        break;
+                    }
+                }
+                return size;
+            }
+
+            static void AppendInt(std::string& out, int value) {
+                char chars[16];
+                const auto result = std::to_chars(std::begin(chars), std::end(chars), value);
+                out.append(chars, result.ptr);
+            }
+
+            Position ToRelative(Position pos) const {
+                return { pos.row - anchor_.row, pos.col - anchor_.col };
+            }
+
+            static bool IsDigit(char c) {
+                return c >= '0' && c <= '9';
+            }
+
+            static bool IsLetter(char c) {
+                return c >= 'A' && c <= 'Z';
+            }
+
+            void SkipSpaces() {
+                while (pos_ < text_.size()
+                    && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+                    ++pos_;
+                }
+            }
+
+            std::size_t SkipDigits(std::size_t pos) const {
+                while (pos < text_.size() && IsDigit(text_[pos])) {
+                    ++pos;
+                }
+                return pos;
+            }
+
+            // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            std::size_t ScanNumber(std::size_t begin) const {
+                std::size_t end = SkipDigits(begin);
+                if (end < text_.size() && text_[end] == '.' && end + 1 < text_.size() && IsDigit(text_[end + 1])) {
+                    end = SkipDigits(end + 1);
+                }
+                else if (end == begin) {
+                    return begin;
+                }
+                if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+                    std::size_t exponent = end + 1;
+                    if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                        ++exponent;
+                    }
+                    const std::size_t exponent_end = SkipDigits(exponent);
+                    if (exponent_end > exponent) {
+                        end = exponent_end;
+                    }
+                }
+                return end;
+            }
+
+            void Next() {
+                SkipSpaces();
+                const std::size_t begin = pos_;
+                if (begin == text_.size()) {
+                    token_ = { Token::End, {} };
+                    return;
+                }
+                const char c = text_[begin];
+                Token::Kind kind;
+                if (IsDigit(c) || c == '.') {
+                    pos_ = ScanNumber(begin);
+                    if (pos_ == begin) {
+                        throw ParsingError("Error when lexing: unexpected '.'");
+                    }
+                    kind = Token::Number;
+                }
+                else if (IsLetter(c)) {
+                    while (pos_ < text_.size() && IsLetter(text_[pos_])) {
+                        ++pos_;
+                    }
+                    const std::size_t letters_end = pos_;
+                    pos_ = SkipDigits(pos_);
+                    if (pos_ > letters_end) {
+                        kind = Token::Cell;
+                    }
+                    else {
+                        // a function name followed by more letters cannot
+                        // start a valid sequence of tokens
+                        GetFunctionByName(text_.substr(begin, pos_ - begin));
+                        kind = Token::Function;
+                    }
+                }
+                else {
+                    ++pos_;
+                    switch (c) {
+                    case '+':
+                        kind = Token::Add;
+                        break;
+                    case '-':
+                        kind = Token::Subtract;
+                        break;
+                    case '*':
+                        kind = Token::Multiply;
+                        break;
+                    case '/':
+                        kind = Token::Divide;
+                        break;
+                    case '(':
+                        kind = Token::LeftParen;
+                        break;
+                    case ')':
+                        kind = Token::RightParen;
+                        break;
+                    case ',':
+                        kind = Token::Comma;
+                        break;
+                    case ':':
+                        kind = Token::Colon;
+                        break;
+                    default:
+                        throw ParsingError("Error when lexing: unexpected '" + std::string(1, c) + "'");
+                    }
+                }
+                token_ = { kind, text_.substr(begin, pos_ - begin) };
+            }
+
+            void Expect(Token::Kind kind) {
+                if (token_.kind != kind) {
+                    throw ParsingError("Unexpected token: " + std::string(token_.text));
+                }
+                Next();
+            }
+
+            // whether the next token, after the current one, is ':'
+            bool ColonFollows() {
+                SkipSpaces();
+                return pos_ < text_.size() && text_[pos_] == ':';
+            }
+
+            Position ParsePosition(std::string_view text) {
+                const auto pos = Position::FromString(text);
+                if (!pos.IsValid()) {
+                    throw FormulaException("Invalid position: " + std::string(text));
+                }
+                return pos;
+            }
+
+            double ParseNumber(std::string_view text) {
+                double value = 0;
+                const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+                if (error == std::errc::result_out_of_range) {
+                    // an overflow is an error, like for a stream; an underflow is not
+                    value = std::strtod(std::string(text).c_str(), nullptr);
+                    if (std::isinf(value)) {
+                        throw ParsingError("Invalid number: " + std::string(text));
+                    }
+                }
+                else if (error != std::errc() || end != text.data() + text.size()) {
+                    throw ParsingError("Invalid number: " + std::string(text));
+                }
+                return value;
+            }
+
+            // Sets the height of the last parsed subtree.
+            void SetHeight(int height) {
+                if (height > MAX_HEIGHT) {
+                    throw ParsingError("A formula is nested too deeply");
+                }
+                height_ = height;
+            }
+
+            // expr (ADD | SUB) expr
+            const Expr* ParseExpr() {
+                const Expr* lhs = ParseTerm();
+                // a chain is one level higher than the highest of its operands
+                int operands_height = height_;
+                while (token_.kind == Token::Add || token_.kind == Token::Subtract) {
+                    const auto type = token_.kind == Token::Add ? BinaryOpExpr::Add : BinaryOpExpr::Subtract;
+                    Next();
+                    const Expr* rhs = ParseTerm();
+                    lhs = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+                    operands_height = std::max(operands_height, height_);
+                    SetHeight(operands_height + 1);
+                }
+                return lhs;
+            }
+
+            // expr (MUL | DIV) expr
+            const Expr* ParseTerm() {
+                const Expr* lhs = ParseUnary();
+                int operands_height = height_;
+                while (token_.kind == Token::Multiply || token_.kind == Token::Divide) {
+                    const auto type = token_.kind == Token::Multiply ? BinaryOpExpr::Multiply : BinaryOpExpr::Divide;
+                    Next();
+                    const Expr* rhs = ParseUnary();
+                    lhs = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+                    operands_height = std::max(operands_height, height_);
+                    SetHeight(operands_height + 1);
+                }
+                return lhs;
+            }
+
+            // (ADD | SUB) expr
+            const Expr* ParseUnary() {
+                // every nested expression is parsed through here, so this
+                // bounds the recursion even where no nodes are made, as for
+                // parentheses
+                if (++nesting_ > MAX_NESTING) {
+                    throw ParsingError("A formula is nested too deeply");
+                }
+                const Expr* expr = nullptr;
+                if (token_.kind == Token::Add || token_.kind == Token::Subtract) {
+                    const auto type = token_.kind == Token::Add ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+                    Next();
+                    const Expr* operand = ParseUnary();
+                    expr = arena_.Make<UnaryOpExpr>(type, operand);
+                    SetHeight(height_ + 1);
+                }
+                else {
+                    expr = ParsePrimary();
+                }
+                --nesting_;
+                return expr;
+            }
+
+            const Expr* ParsePrimary() {
+                const Token token = token_;
+                switch (token.kind) {
+                case Token::Number:
+                    Next();
+                    SetHeight(1);
+                    return arena_.Make<NumberExpr>(ParseNumber(token.text));
+                case Token::Cell: {
+                    const Position cell = ToRelative(ParsePosition(token.text));
+                    Next();
+                    SetHeight(1);
+                    return arena_.Make<CellExpr>(cell);
+                }
+                case Token::LeftParen: {
+                    Next();
+                    const Expr* expr = ParseExpr();
+                    Expect(Token::RightParen);
+                    return expr;
+                }
+                case Token::Function: {
+                    const auto function = GetFunctionByName(token.text);
+                    Next();
+                    Expect(Token::LeftParen);
+                    args_.push_back(ParseArg());
+                    std::size_t arg_count = 1;
+                    int args_height = height_;
+                    while (token_.kind == Token::Comma) {
+                        Next();
+                        args_.push_back(ParseArg());
+                        ++arg_count;
+                        args_height = std::max(args_height, height_);
+                    }
+                    Expect(Token::RightParen);
+                    SetHeight(args_height + 1);
+                    return MakeFunction(arena_, function, args_, arg_count);
+                }
+                default:
+                    throw ParsingError("Unexpected token: " + std::string(token.text));
+                }
+            }
+
+            // range: CELL ':' CELL
+            const Expr* ParseArg() {
+                if (token_.kind != Token::Cell || !ColonFollows()) {
+                    return ParseExpr();
+                }
+                const std::string_view first = token_.text;
+                Next();
+                Expect(Token::Colon);
+                if (token_.kind != Token::Cell) {
+                    throw ParsingError("Unexpected token: " + std::string(token_.text));
+                }
+                const std::string_view second = token_.text;
+                const auto first_pos = Position::FromString(first);
+                const auto second_pos = Position::FromString(second);
+                if (!first_pos.IsValid() || !second_pos.IsValid()) {
+                    throw FormulaException("Invalid range: " + std::string(first) + ':' + std::string(second));
+                }
+                Next();
+                SetHeight(1);
+                return arena_.Make<RangeExpr>(Range::FromCorners(ToRelative(first_pos), ToRelative(second_pos)));
+            }
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener {
@@ -403,7 +1599,17 @@ namespace ASTImpl {
     }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+FormulaAST ParseFormulaAST(std::string_view in, Position anchor) {
+    ASTImpl::Parser parser(in, anchor);
+    const auto root = parser.ParseMain();
+    return FormulaAST(parser.MoveArena(), root);
+}
+
+void AppendFormulaShape(std::string_view in, Position anchor, std::string& out) {
+    ASTImpl::Parser(in, anchor).AppendShape(out);
+}
+
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -424,36 +1630,234 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveArena(), listener.GetRoot());
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+Range FormulaAST::ToAbsolute(Range offset, Position anchor) {
+    return { ToAbsolute(offset.top_left, anchor), ToAbsolute(offset.bottom_right, anchor) };
 }
 
-void FormulaAST::PrintCells(std::ostream& out) const {
+void FormulaAST::Save(std::string& out, Position anchor) const {
+    root_expr_->Save(out, anchor);
+}
+
+FormulaAST FormulaAST::Load(std::string_view& in) {
+    ASTImpl::TreeLoader loader;
+    const auto root = loader.LoadNode(in);
+    if (root->GetRange()) {
+        throw ParsingError("A range outside of a function in a saved formula");
+    }
+    return FormulaAST(loader.MoveArena(), root);
+}
+
+void FormulaAST::PrintCells(std::ostream& out, Position anchor) const {
     for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+        out << ToAbsolute(cell, anchor).ToString() << ' ';
     }
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+void FormulaAST::Print(std::ostream& out, Position anchor) const {
+    root_expr_->Print(out, anchor);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+    root_expr_->PrintFormula(out, anchor, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+FormulaAST::Value FormulaAST::Execute(const SheetInterface& sheet, Position anchor) const {
+    using ASTImpl::Instruction;
+
+    // most formulas fit into the buffer on the stack
+    constexpr std::size_t STACK_BUFFER_SIZE = 64;
+    double stack_buffer[STACK_BUFFER_SIZE];
+    std::unique_ptr<double[]> heap_stack;
+    double* stack = stack_buffer;
+    if (max_stack_depth_ > STACK_BUFFER_SIZE) {
+        heap_stack = std::make_unique<double[]>(max_stack_depth_);
+        stack = heap_stack.get();
+    }
+
+    // aggregates being accumulated, the innermost one is the last
+    std::vector<ASTImpl::Aggregate> aggregates;
+
+    // `top` points past the last value on the stack
+    double* top = stack;
+    for (const Instruction& instruction : program_) {
+        switch (instruction.code) {
+        case Instruction::OpCode::PushNumber:
+            *top++ = instruction.number;
+            continue;
+        case Instruction::OpCode::LoadCell: {
+            const auto value = ASTImpl::GetCellNumber(sheet, ToAbsolute(instruction.cell, anchor));
+            if (!std::holds_alternative<double>(value)) {
+                return value;
+            }
+            *top++ = std::get<double>(value);
+            continue;
+        }
+        case Instruction::OpCode::Negate:
+            top[-1] = -top[-1];
+            continue;
+        case Instruction::OpCode::BeginAggregate:
+            aggregates.emplace_back(instruction.function);
+            continue;
+        case Instruction::OpCode::AccumulateValue:
+            aggregates.back().Add(*--top);
+            continue;
+        case Instruction::OpCode::AccumulateRange:
+            if (auto error = aggregates.back().AddRange(sheet, ToAbsolute(instruction.range, anchor))) {
+                return *error;
+            }
+            continue;
+        case Instruction::OpCode::EndAggregate: {
+            const auto result = aggregates.back().GetResult();
+            if (!std::holds_alternative<double>(result)) {
+                return result;
+            }
+            aggregates.pop_back();
+            *top++ = std::get<double>(result);
+            continue;
+        }
+        case Instruction::OpCode::Add:
+            --top;
+            top[-1] += top[0];
+            break;
+        case Instruction::OpCode::Subtract:
+            --top;
+            top[-1] -= top[0];
+            break;
+        case Instruction::OpCode::Multiply:
+            --top;
+            top[-1] *= top[0];
+            break;
+        case Instruction::OpCode::Divide:
+            --top;
+            if (top[0] == 0) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            top[-1] /= top[0];
+            break;
+        case Instruction::OpCode::AddNumber:
+            top[-1] += instruction.number;
+            break;
+        case Instruction::OpCode::SubtractNumber:
+            top[-1] -= instruction.number;
+            break;
+        case Instruction::OpCode::MultiplyNumber:
+            top[-1] *= instruction.number;
+            break;
+        case Instruction::OpCode::DivideNumber:
+            if (instruction.number == 0) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            top[-1] /= instruction.number;
+            break;
+        }
+        // only binary operations get here
+        if (std::isinf(top[-1])) {
+            return FormulaError(FormulaError::Category::Div0);
+        }
+    }
+    assert(top == stack + 1);
+    return stack[0];
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+FormulaAST::Value FormulaAST::ExecuteTree(const SheetInterface& sheet, Position anchor) const {
+    return root_expr_->Evaluate(sheet, anchor);
+}
+
+FormulaAST::FormulaAST(ASTImpl::Arena arena, const ASTImpl::Expr* root_expr)
+    : arena_(std::move(arena))
+    , root_expr_(root_expr) {
+    root_expr_->Compile(program_);
+    ASTImpl::FoldConstants(program_);
+    program_.shrink_to_fit();
+    std::size_t depth = 0;
+    for (const auto& instruction : program_) {
+        switch (instruction.code) {
+        case ASTImpl::Instruction::OpCode::LoadCell:
+            cells_.push_back(instruction.cell);
+            [[fallthrough]];
+        case ASTImpl::Instruction::OpCode::PushNumber:
+        case ASTImpl::Instruction::OpCode::EndAggregate:
+            max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+            break;
+        case ASTImpl::Instruction::OpCode::AccumulateRange:
+            ranges_.push_back(instruction.range);
+            break;
+        case ASTImpl::Instruction::OpCode::AddNumber:
+        case ASTImpl::Instruction::OpCode::SubtractNumber:
+        case ASTImpl::Instruction::OpCode::MultiplyNumber:
+        case ASTImpl::Instruction::OpCode::DivideNumber:
+        case ASTImpl::Instruction::OpCode::Negate:
+        case ASTImpl::Instruction::OpCode::BeginAggregate:
+            break;
+        default:
+            --depth;
+            break;
+        }
+    }
+
+    // sorted once here, so that GetReferencedCells only has to copy them
+    std::sort(cells_.begin(), cells_.end());
+    cells_.erase(std::unique(cells_.begin(), cells_.end()), cells_.end());
+    cells_.shrink_to_fit();
+    std::sort(ranges_.begin(), ranges_.end());
+    ranges_.erase(std::unique(ranges_.begin(), ranges_.end()), ranges_.end());
+    ranges_.shrink_to_fit();
 }
 
+namespace ASTImpl {
+    Arena::Arena(Arena&& other) noexcept
+        : last_(std::exchange(other.last_, nullptr))
+        , next_(std::exchange(other.next_, nullptr))
+        , available_(std::exchange(other.available_, 0)) {
+    }
+
+    Arena& Arena::operator=(Arena&& other) noexcept {
+        if (this != &other) {
+            Release();
+            last_ = std::exchange(other.last_, nullptr);
+            next_ = std::exchange(other.next_, nullptr);
+            available_ = std::exchange(other.available_, 0);
+        }
+        return *this;
+    }
+
+    Arena::~Arena() {
+        Release();
+    }
+
+    void* Arena::Allocate(std::size_t size, std::size_t alignment) {
+        // blocks are aligned for any fundamental type
+        assert(alignment <= alignof(std::max_align_t));
+        std::size_t padding = (alignment - reinterpret_cast<std::uintptr_t>(next_) % alignment) % alignment;
+        if (last_ == nullptr || padding + size > available_) {
+            const std::size_t capacity = std::max(size, last_ == nullptr ? first_block_capacity_ : last_->capacity * 2);
+            constexpr std::size_t header_size = (sizeof(Block) + alignof(std::max_align_t) - 1)
+                / alignof(std::max_align_t) * alignof(std::max_align_t);
+            char* memory = static_cast<char*>(::operator new(header_size + capacity));
+            last_ = new (memory) Block{ last_, capacity };
+            next_ = memory + header_size;
+            available_ = capacity;
+            padding = 0;
+        }
+        void* result = next_ + padding;
+        next_ += padding + size;
+        available_ -= padding + size;
+        return result;
+    }
+
+    void Arena::Release() noexcept {
+        while (last_ != nullptr) {
+            ::operator delete(std::exchange(last_, last_->previous));
+        }
+        next_ = nullptr;
+        available_ = 0;
+    }
+}  // namespace ASTImpl
+
+FormulaAST::FormulaAST(FormulaAST&&) noexcept = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) noexcept = default;
+
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
@@ -3,12 +3,105 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
+
+// Aggregate functions; their arguments may be cell ranges as well as values.
+enum class Function : std::uint8_t {
+    Sum,
+    Min,
+    Max,
+    Average,
+    Count,
+};
+
+// Allocates the nodes of one tree from a chain of blocks that are freed
+// together. Destructors of the objects are never run, so only trivially
+// destructible types may be placed here. Builders create the children of a
+// node before the node itself, so the nodes end up in evaluation order.
+class Arena {
+public:
+    Arena() = default;
+    // the first block is allocated on demand with at least this capacity
+    explicit Arena(std::size_t first_block_capacity)
+        : first_block_capacity_(first_block_capacity) {
+    }
+    Arena(Arena&& other) noexcept;
+    Arena& operator=(Arena&& other) noexcept;
+    ~Arena();
+
+    template <typename T, typename... Args>
+    T* Make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>);
+        return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    T* MakeArray(const T* values, std::size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T* result = static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+        std::uninitialized_copy(values, values + count, result);
+        return result;
+    }
+
+private:
+    struct Block {
+        Block* previous;
+        std::size_t capacity;
+    };
+
+    void* Allocate(std::size_t size, std::size_t alignment);
+    void Release() noexcept;
+
+    std::size_t first_block_capacity_ = 128;
+    Block* last_ = nullptr;
+    char* next_ = nullptr;
+    std::size_t available_ = 0;
+};
+
+// An instruction of the postfix program that a formula is compiled into.
+// Operands are taken from and results are pushed onto the evaluation stack.
+struct Instruction {
+    enum class OpCode : std::uint8_t {
+        PushNumber,  // pushes `number`
+        LoadCell,    // pushes the numeric value of `cell`
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        // binary operations with `number` as the right operand
+        AddNumber,
+        SubtractNumber,
+        MultiplyNumber,
+        DivideNumber,
+        Negate,
+        BeginAggregate,   // starts a new aggregate of `function`
+        AccumulateValue,  // moves the top of the stack into the current aggregate
+        AccumulateRange,  // adds the non-empty cells of `range` to the current aggregate
+        EndAggregate,     // pushes the result of the current aggregate
+    };
+
+    OpCode code;
+    Function function = Function::Sum;
+    union {
+        double number = 0.0;
+        Position cell;
+        Range range;
+    };
+};
 }
 
 class ParsingError : public std::runtime_error {
@@ -17,30 +110,68 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    // the result of evaluation; errors are returned rather than thrown
+    using Value = std::variant<double, FormulaError>;
+
+    // the nodes of the tree are allocated from `arena`
+    FormulaAST(ASTImpl::Arena arena, const ASTImpl::Expr* root_expr);
+    FormulaAST(FormulaAST&&) noexcept;
+    FormulaAST& operator=(FormulaAST&&) noexcept;
 
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    // Positions in the formula are stored relative to an anchor cell, so
+    // that formulas differing only by a shift of all references together with
+    // their cell can share one tree. The methods below take the anchor; with
+    // the default one the stored positions are absolute.
+    static Position ToAbsolute(Position offset, Position anchor) {
+        return { offset.row + anchor.row, offset.col + anchor.col };
+    }
+    static Range ToAbsolute(Range offset, Position anchor);
+
+    // Runs the compiled program.
+    Value Execute(const SheetInterface& sheet, Position anchor = {}) const;
+    // Evaluates the formula by walking the tree; the reference implementation
+    // for Execute, used by tests and benchmarks.
+    Value ExecuteTree(const SheetInterface& sheet, Position anchor = {}) const;
 
-    void Print(std::ostream& out) const;
-    void PrintCells(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void Print(std::ostream& out, Position anchor = {}) const;
+    void PrintCells(std::ostream& out, Position anchor = {}) const;
+    void PrintFormula(std::ostream& out, Position anchor = {}) const;
 
-    std::forward_list<Position>& GetCells() {
+    // Appends the tree with absolute positions in a compact binary form; Load
+    // restores the formula from it without parsing and consumes the read
+    // bytes from `in`. Load throws ParsingError if the data is malformed.
+    void Save(std::string& out, Position anchor = {}) const;
+    static FormulaAST Load(std::string_view& in);
+
+    // cells and ranges are relative to the anchor, sorted and without
+    // duplicates
+    const std::vector<Position>& GetCells() const {
         return cells_;
     }
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // ranges are kept as rectangles and are not expanded into cells_
+    const std::vector<Range>& GetRanges() const {
+        return ranges_;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    ASTImpl::Arena arena_;
+    const ASTImpl::Expr* root_expr_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+    std::vector<ASTImpl::Instruction> program_;
+    std::size_t max_stack_depth_ = 0;
 };
 
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+// Parses the formula with the hand-written parser; positions are stored
+// relative to `anchor`.
+FormulaAST ParseFormulaAST(std::string_view in, Position anchor = {});
+// Appends the shape of the formula: the formula with all references replaced
+// by their offsets from `anchor`. Formulas of the same shape are parsed by
+// ParseFormulaAST into the same tree when each one is taken relative to its
+// anchor. Throws like ParseFormulaAST on lexer errors and invalid positions.
+void AppendFormulaShape(std::string_view in, Position anchor, std::string& out);
+// Parses the formula with the parser generated by ANTLR from Formula.g4; the
+// reference implementation for ParseFormulaAST, used by tests and benchmarks.
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in);
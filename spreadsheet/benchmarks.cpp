@@ -0,0 +1,814 @@
+#include "FormulaAST.h"
+#include "common.h"
+#include "formula.h"
+#include "log_duration.h"
+#include "memory_usage.h"
+#include "output_sink.h"
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+    void PrintMemoryUsage(const std::string& name, MemoryUsage before, MemoryUsage after, int cells) {
+        const std::size_t bytes = after.bytes - before.bytes;
+        const std::size_t allocations = after.allocations - before.allocations;
+        std::cerr << name << ": " << bytes / (1024 * 1024) << " MiB, "
+            << static_cast<double>(bytes) / cells << " bytes/cell, "
+            << allocations << " allocations" << std::endl;
+    }
+
+    constexpr int BENCH_ROWS = 1000;
+    constexpr int BENCH_COLS = 1000;
+
+    // Прежнее представление ячейки: полиморфная реализация в куче, в каждой
+    // из которых хранятся таблица, позиция, родители и закэшированное значение.
+    namespace legacy {
+        class Impl {
+        public:
+            virtual ~Impl() = default;
+
+        protected:
+            SheetInterface* sheet_ptr_ = nullptr;
+            Position pos_;
+            std::vector<Position> parent_cells_;
+            CellInterface::Value cached_value_;
+        };
+
+        class EmptyImpl : public Impl {
+        };
+
+        class TextImpl : public Impl {
+        public:
+            explicit TextImpl(std::string text)
+                : value_(std::move(text)) {
+            }
+
+        private:
+            std::string value_;
+        };
+
+        class Cell {
+        public:
+            Cell() = default;
+            Cell(Cell&&) noexcept = default;
+            virtual ~Cell() = default;
+
+            std::unique_ptr<Impl> impl_ = std::make_unique<EmptyImpl>();
+        };
+    }  // namespace legacy
+
+    void BenchmarkCellLayoutMemory() {
+        std::cerr << "Cell layout memory, " << BENCH_ROWS * BENCH_COLS << " cells" << std::endl;
+        {
+            const auto before = CurrentMemoryUsage();
+            std::vector<std::vector<legacy::Cell>> sheet(BENCH_ROWS);
+            for (auto& row : sheet) {
+                row.resize(BENCH_COLS);
+                for (auto& cell : row) {
+                    cell.impl_ = std::make_unique<legacy::TextImpl>("12345");
+                }
+            }
+            PrintMemoryUsage("  legacy dense layout", before, CurrentMemoryUsage(), BENCH_ROWS * BENCH_COLS);
+        }
+        {
+            const auto before = CurrentMemoryUsage();
+            auto sheet = CreateSheet();
+            for (int row = 0; row < BENCH_ROWS; ++row) {
+                for (int col = 0; col < BENCH_COLS; ++col) {
+                    sheet->SetCell({ row, col }, "12345");
+                }
+            }
+            PrintMemoryUsage("  compact chunked layout", before, CurrentMemoryUsage(), BENCH_ROWS * BENCH_COLS);
+        }
+    }
+
+    constexpr int FILL_COLS = 64;
+
+    // Заполнение таблицы во всю высоту по столбцам и по строкам. Таблица не
+    // перестраивает уже заполненные ячейки при росте в ширину, поэтому
+    // добавление столбца стоит одинаково, сколько бы столбцов ни было слева.
+    void BenchmarkFillOrder() {
+        const int rows = Position::MAX_ROWS;
+        const std::string name = "Fill " + std::to_string(rows) + "x" + std::to_string(FILL_COLS) + " cells";
+        for (const bool column_major : { true, false }) {
+            auto sheet = CreateSheet();
+            LOG_DURATION(name + (column_major ? ", column-major" : ", row-major"));
+            for (int i = 0; i < rows * FILL_COLS; ++i) {
+                const Position pos = column_major ? Position{ i % rows, i / rows } : Position{ i / FILL_COLS, i % FILL_COLS };
+                sheet->SetCell(pos, "12345");
+            }
+        }
+        auto sheet = CreateSheet();
+        for (int col = 0; col < FILL_COLS; ++col) {
+            const auto start = std::chrono::steady_clock::now();
+            for (int row = 0; row < rows; ++row) {
+                sheet->SetCell({ row, col }, "12345");
+            }
+            const auto duration = std::chrono::steady_clock::now() - start;
+            if (col == 0 || col == FILL_COLS - 1) {
+                std::cerr << "  column " << col + 1 << ": "
+                    << std::chrono::duration_cast<std::chrono::microseconds>(duration).count() << " us" << std::endl;
+            }
+        }
+    }
+
+    // Каждый уровень цепочки состоит из двух ячеек, и обе ссылаются на обе
+    // ячейки предыдущего уровня, поэтому число путей от верхней ячейки до
+    // нижней растёт как 2^DIAMOND_DEPTH.
+    constexpr int DIAMOND_DEPTH = 2000;
+    constexpr int DIAMOND_EDITS = 100;
+
+    void BenchmarkDiamondInvalidation() {
+        auto sheet = CreateSheet();
+        sheet->SetCell({ 0, 0 }, "1");
+        sheet->SetCell({ 0, 1 }, "1");
+        for (int row = 1; row < DIAMOND_DEPTH; ++row) {
+            const std::string a = Position{ row - 1, 0 }.ToString();
+            const std::string b = Position{ row - 1, 1 }.ToString();
+            sheet->SetCell({ row, 0 }, "=" + a + "+" + b + "-" + b);
+            sheet->SetCell({ row, 1 }, "=" + b + "+" + a + "-" + a);
+        }
+        const Position bottom{ DIAMOND_DEPTH - 1, 0 };
+
+        LOG_DURATION("Diamond chain invalidation, depth " + std::to_string(DIAMOND_DEPTH)
+            + ", " + std::to_string(DIAMOND_EDITS) + " edits");
+        for (int i = 0; i < DIAMOND_EDITS; ++i) {
+            sheet->GetCell(bottom)->GetValue();
+            sheet->SetCell({ 0, 0 }, std::to_string(i));
+        }
+    }
+
+    constexpr int REPEATED_EDITS = 100000;
+
+    void BenchmarkRepeatedFormulaEdits() {
+        auto sheet = CreateSheet();
+        for (int col = 0; col < 100; ++col) {
+            sheet->SetCell({ 0, col }, std::to_string(col));
+        }
+        const auto before = CurrentMemoryUsage();
+        {
+            LOG_DURATION("Repeated formula edits of one cell, " + std::to_string(REPEATED_EDITS) + " edits");
+            for (int i = 0; i < REPEATED_EDITS; ++i) {
+                const std::string ref = Position{ 0, i % 100 }.ToString();
+                sheet->SetCell({ 1, 0 }, "=" + ref + "+" + ref);
+            }
+        }
+        PrintMemoryUsage("  memory growth", before, CurrentMemoryUsage(), 1);
+    }
+
+    constexpr int EVALUATED_NODES = 10000000;
+
+    // Формула из operand_count операндов (ячеек и чисел вперемешку) содержит
+    // 2 * operand_count - 1 узлов.
+    std::string MakeLongFormula(int operand_count) {
+        const char operations[] = { '+', '-', '*' };
+        std::string formula;
+        for (int i = 0; i < operand_count; ++i) {
+            if (i > 0) {
+                formula += operations[i % 3];
+            }
+            formula += (i % 2 == 0) ? "A1" : "0.5";
+        }
+        return formula;
+    }
+
+    void BenchmarkFormulaEvaluation() {
+        auto sheet = CreateSheet();
+        sheet->SetCell({ 0, 0 }, "1.5");
+        for (int operand_count : { 1, 6, 51, 501 }) {
+            const auto ast = ParseFormulaAST(MakeLongFormula(operand_count));
+            const int node_count = 2 * operand_count - 1;
+            const int repeats = EVALUATED_NODES / node_count;
+            const std::string name = "Evaluate formula of " + std::to_string(node_count)
+                + " nodes " + std::to_string(repeats) + " times";
+            double tree_sum = 0.0;
+            double bytecode_sum = 0.0;
+            {
+                LOG_DURATION(name + ", tree walk");
+                for (int i = 0; i < repeats; ++i) {
+                    tree_sum += std::get<double>(ast.ExecuteTree(*sheet));
+                }
+            }
+            {
+                LOG_DURATION(name + ", bytecode");
+                for (int i = 0; i < repeats; ++i) {
+                    bytecode_sum += std::get<double>(ast.Execute(*sheet));
+                }
+            }
+            if (tree_sum != bytecode_sum) {
+                std::cerr << "  results differ: " << tree_sum << " != " << bytecode_sum << std::endl;
+            }
+        }
+    }
+
+    constexpr int PARSED_FORMULAS = 200000;
+
+    // Разбор типичных коротких формул рукописным разборщиком и ANTLR.
+    void BenchmarkFormulaParsing() {
+        const std::vector<std::string> formulas = { "A1+1", "B12*C3-D4/2", "SUM(A1:A100)",
+            "(A1+B1)*(C1-D1)", "MAX(A1,B2:C3,-1.5e2)", "-A1*2+AVERAGE(B1:B9)/COUNT(C1:C9)" };
+        std::size_t hand_written_cells = 0;
+        const std::string name = "Parse " + std::to_string(PARSED_FORMULAS) + " formulas";
+        {
+            LOG_DURATION(name + ", hand-written");
+            for (int i = 0; i < PARSED_FORMULAS; ++i) {
+                const auto ast = ParseFormulaAST(formulas[i % formulas.size()]);
+                hand_written_cells += ast.GetCells().size();
+            }
+        }
+#ifdef SPREADSHEET_ANTLR_GENERATED
+        std::size_t antlr_cells = 0;
+        {
+            LOG_DURATION(name + ", ANTLR");
+            for (int i = 0; i < PARSED_FORMULAS; ++i) {
+                std::istringstream in(formulas[i % formulas.size()]);
+                const auto ast = ParseFormulaASTWithAntlr(in);
+                antlr_cells += ast.GetCells().size();
+            }
+        }
+        if (hand_written_cells != antlr_cells) {
+            std::cerr << "  cells differ: " << hand_written_cells << " != " << antlr_cells << std::endl;
+        }
+#else
+        std::cerr << name << ", ANTLR: skipped, the ANTLR parser is not generated from Formula.g4" << std::endl;
+#endif
+
+        // память и число выделений на одно хранимое дерево
+        std::vector<FormulaAST> asts;
+        asts.reserve(PARSED_FORMULAS);
+        const auto before = CurrentMemoryUsage();
+        for (int i = 0; i < PARSED_FORMULAS; ++i) {
+            asts.push_back(ParseFormulaAST(formulas[i % formulas.size()]));
+        }
+        PrintMemoryUsage("  " + std::to_string(PARSED_FORMULAS) + " parsed formulas", before,
+            CurrentMemoryUsage(), PARSED_FORMULAS);
+    }
+
+    constexpr int SHARED_FORMULA_ROWS = 16000;
+    constexpr int SHARED_FORMULA_COLS = 6;
+
+    // Формулы одного вида (=A1*B1 в C1, =A2*B2 в C2, ...) против формул, каждая
+    // из которых своего вида (=A1*B1 в C1, =A1*B2 в C2, ...).
+    void BenchmarkFormulaSharing() {
+        const int formula_count = SHARED_FORMULA_ROWS * SHARED_FORMULA_COLS;
+        for (const bool same_shape : { true, false }) {
+            std::vector<std::pair<Position, std::string>> cells;
+            for (int row = 0; row < SHARED_FORMULA_ROWS; ++row) {
+                for (int col = 2; col < SHARED_FORMULA_COLS + 2; ++col) {
+                    const Position lhs = same_shape ? Position{ row, col - 2 } : Position{ 0, 0 };
+                    cells.emplace_back(Position{ row, col },
+                        "=" + lhs.ToString() + "*" + Position{ row, col - 1 }.ToString());
+                }
+            }
+            auto sheet = CreateSheet();
+            const auto before = CurrentMemoryUsage();
+            {
+                LOG_DURATION("SetCells of " + std::to_string(formula_count) + " formulas, "
+                    + (same_shape ? "one shape" : "distinct shapes"));
+                sheet->SetCells(std::move(cells));
+            }
+            PrintMemoryUsage("  memory", before, CurrentMemoryUsage(), formula_count);
+        }
+    }
+
+    constexpr int COLUMN_HEIGHT = 10000;
+    constexpr int COLUMN_TOTALS = 1000;
+
+    void BenchmarkColumnTotal() {
+        auto sheet = CreateSheet();
+        std::string long_formula;
+        for (int row = 0; row < COLUMN_HEIGHT; ++row) {
+            sheet->SetCell({ row, 0 }, std::to_string(row % 100));
+            if (row > 0) {
+                long_formula += '+';
+            }
+            long_formula += Position{ row, 0 }.ToString();
+        }
+        const std::string sum_formula = "SUM(A1:" + Position{ COLUMN_HEIGHT - 1, 0 }.ToString() + ")";
+        for (const auto& [name, formula] : { std::pair{ "additions", long_formula },
+                                              std::pair{ "SUM", sum_formula } }) {
+            const std::string title = "Total of " + std::to_string(COLUMN_HEIGHT) + " cells with " + name;
+            const auto ast = [&] {
+                LOG_DURATION(title + ", parse");
+                return ParseFormulaAST(formula);
+            }();
+            double total = 0.0;
+            {
+                LOG_DURATION(title + ", " + std::to_string(COLUMN_TOTALS) + " evaluations");
+                for (int i = 0; i < COLUMN_TOTALS; ++i) {
+                    total += std::get<double>(ast.Execute(*sheet));
+                }
+            }
+            std::cerr << "  total: " << total << std::endl;
+        }
+    }
+
+    constexpr int RANGE_FORMULAS = 1000;
+    constexpr int RANGE_COLS = 10;
+    constexpr int RANGE_EDITS = 10000;
+
+    // Каждая формула ссылается на диапазон из RANGE_COLS * MAX_ROWS ячеек.
+    void BenchmarkRangeDependencies() {
+        auto sheet = CreateSheet();
+        const std::string range = "A1:" + Position{ Position::MAX_ROWS - 1, RANGE_COLS - 1 }.ToString();
+        const auto before = CurrentMemoryUsage();
+        {
+            LOG_DURATION("Set " + std::to_string(RANGE_FORMULAS) + " formulas =SUM(" + range + ")");
+            for (int row = 0; row < RANGE_FORMULAS; ++row) {
+                sheet->SetCell({ row, RANGE_COLS + 1 }, "=SUM(" + range + ")+" + std::to_string(row));
+            }
+        }
+        PrintMemoryUsage("  memory", before, CurrentMemoryUsage(), RANGE_FORMULAS);
+        {
+            LOG_DURATION("Edit " + std::to_string(RANGE_EDITS) + " cells inside the ranges");
+            for (int i = 0; i < RANGE_EDITS; ++i) {
+                sheet->SetCell({ i * 7 % Position::MAX_ROWS, i % RANGE_COLS }, std::to_string(i));
+            }
+        }
+    }
+
+    constexpr int CHAIN_LENGTH = 100000;
+    constexpr int CHAIN_WIDTH = 316;
+
+    // Звенья цепочки раскладываются по прямоугольнику, а не в один столбец,
+    // чтобы не создавать лишних блоков ячеек.
+    Position ChainPosition(int index) {
+        return { index / CHAIN_WIDTH, index % CHAIN_WIDTH };
+    }
+
+    void BenchmarkChainLoad() {
+        {
+            auto sheet = CreateSheet();
+            LOG_DURATION("Chain load, " + std::to_string(CHAIN_LENGTH) + " formulas, forward");
+            sheet->SetCell(ChainPosition(0), "1");
+            for (int i = 1; i < CHAIN_LENGTH; ++i) {
+                sheet->SetCell(ChainPosition(i), "=" + ChainPosition(i - 1).ToString() + "+1");
+            }
+        }
+        {
+            auto sheet = CreateSheet();
+            LOG_DURATION("Chain load, " + std::to_string(CHAIN_LENGTH) + " formulas, backward");
+            for (int i = CHAIN_LENGTH - 1; i > 0; --i) {
+                sheet->SetCell(ChainPosition(i), "=" + ChainPosition(i - 1).ToString() + "+1");
+            }
+            sheet->SetCell(ChainPosition(0), "1");
+        }
+    }
+
+    constexpr int RECALC_CHAIN_LENGTH = 1000000;
+    constexpr int RECALC_CHAIN_WIDTH = 1000;
+
+    void BenchmarkRecalculateChain() {
+        auto sheet = CreateSheet();
+        auto chain_pos = [](int index) {
+            return Position{ index / RECALC_CHAIN_WIDTH, index % RECALC_CHAIN_WIDTH };
+        };
+        sheet->SetCell(chain_pos(0), "1");
+        for (int i = 1; i < RECALC_CHAIN_LENGTH; ++i) {
+            sheet->SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+        }
+        {
+            LOG_DURATION("Recalculate chain of " + std::to_string(RECALC_CHAIN_LENGTH) + " formulas");
+            sheet->Recalculate();
+        }
+        std::cerr << "  last value: "
+            << std::get<double>(sheet->GetCell(chain_pos(RECALC_CHAIN_LENGTH - 1))->GetValue()) << std::endl;
+    }
+
+    constexpr int ERROR_CHAIN_LENGTH = 100000;
+    constexpr int ERROR_RECALCULATIONS = 10;
+
+    // Ошибка в начале цепочки распространяется на все её ячейки.
+    void BenchmarkErrorRecalculate() {
+        auto sheet = CreateSheet();
+        auto chain_pos = [](int index) {
+            return Position{ index / RECALC_CHAIN_WIDTH, index % RECALC_CHAIN_WIDTH };
+        };
+        sheet->SetCell(chain_pos(0), "=1/0");
+        for (int i = 1; i < ERROR_CHAIN_LENGTH; ++i) {
+            sheet->SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+        }
+        LOG_DURATION("Recalculate chain of " + std::to_string(ERROR_CHAIN_LENGTH) + " error formulas "
+            + std::to_string(ERROR_RECALCULATIONS) + " times");
+        for (int i = 0; i < ERROR_RECALCULATIONS; ++i) {
+            sheet->SetCell(chain_pos(0), "=" + std::to_string(i) + "/0");
+            sheet->Recalculate();
+        }
+    }
+
+    constexpr int WIDE_ROWS = 200;
+    constexpr int WIDE_COLS = 1000;
+
+    void BenchmarkParallelRecalculate() {
+        auto sheet = CreateSheet();
+        for (int col = 0; col < WIDE_COLS; ++col) {
+            sheet->SetCell({ 0, col }, std::to_string(col));
+        }
+        for (int row = 1; row < WIDE_ROWS; ++row) {
+            for (int col = 0; col < WIDE_COLS; ++col) {
+                const Position lhs{ row - 1, col };
+                const Position rhs{ row - 1, (col + 1) % WIDE_COLS };
+                sheet->SetCell({ row, col }, "=(" + lhs.ToString() + "+" + rhs.ToString() + ")/2");
+            }
+        }
+        const std::size_t max_threads = std::max(4u, std::thread::hardware_concurrency());
+        for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+            for (int col = 0; col < WIDE_COLS; ++col) {
+                sheet->SetCell({ 0, col }, std::to_string(col + threads));
+            }
+            sheet->SetRecalculationThreads(threads);
+            LOG_DURATION("Parallel recalculate, " + std::to_string((WIDE_ROWS - 1) * WIDE_COLS)
+                + " formulas, " + std::to_string(threads) + " threads");
+            sheet->Recalculate();
+        }
+    }
+
+    constexpr int NARROW_CHAIN_LENGTH = 100000;
+    constexpr std::size_t NARROW_CHAIN_THREADS = 4;
+
+    // В цепочке в каждый момент готова только одна формула, поэтому остальные
+    // потоки простаивают и не должны расходовать процессорное время.
+    void BenchmarkNarrowParallelRecalculate() {
+        auto sheet = CreateSheet();
+        sheet->SetCell(ChainPosition(0), "1");
+        for (int i = 1; i < NARROW_CHAIN_LENGTH; ++i) {
+            sheet->SetCell(ChainPosition(i), "=" + ChainPosition(i - 1).ToString() + "+1");
+        }
+        sheet->SetCell(ChainPosition(0), "2");
+        sheet->SetRecalculationThreads(NARROW_CHAIN_THREADS);
+        const std::clock_t cpu_start = std::clock();
+        {
+            LOG_DURATION("Parallel recalculate, chain of " + std::to_string(NARROW_CHAIN_LENGTH)
+                + " formulas, " + std::to_string(NARROW_CHAIN_THREADS) + " threads");
+            sheet->Recalculate();
+        }
+        std::cerr << "  CPU time: " << (std::clock() - cpu_start) * 1000 / CLOCKS_PER_SEC << " ms" << std::endl;
+    }
+
+    constexpr int IMPORT_ROWS = 500;
+    constexpr int IMPORT_COLS = 1000;
+
+    // Импорт в порядке, при котором каждая новая строка формул ссылается на
+    // уже вычисленные значения: сброс кэша при поячеечной записи повторяется
+    // для всех зависимых ячеек.
+    std::vector<std::pair<Position, std::string>> MakeImportCells() {
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.reserve(IMPORT_ROWS * IMPORT_COLS);
+        for (int row = IMPORT_ROWS - 1; row >= 0; --row) {
+            for (int col = 0; col < IMPORT_COLS; ++col) {
+                if (row == 0) {
+                    cells.emplace_back(Position{ row, col }, std::to_string(col));
+                }
+                else {
+                    cells.emplace_back(Position{ row, col }, "=" + Position{ row - 1, col }.ToString() + "*2");
+                }
+            }
+        }
+        return cells;
+    }
+
+    void BenchmarkBatchImport() {
+        const std::string name = "Import " + std::to_string(IMPORT_ROWS * IMPORT_COLS) + " cells";
+        {
+            auto cells = MakeImportCells();
+            auto sheet = CreateSheet();
+            LOG_DURATION(name + ", SetCell");
+            for (auto& [pos, text] : cells) {
+                sheet->SetCell(pos, std::move(text));
+            }
+        }
+        {
+            auto cells = MakeImportCells();
+            auto sheet = CreateSheet();
+            LOG_DURATION(name + ", SetCells");
+            sheet->SetCells(std::move(cells));
+        }
+    }
+
+    constexpr int READ_ROWS = 1000;
+    constexpr int READ_COLS = 100;
+    constexpr int READ_PASSES = 10;
+
+    // Чтение значений таблицы, в которой поровну коротких текстов, длинных
+    // экранированных текстов, чисел и формул.
+    void BenchmarkValueReads() {
+        auto sheet = CreateSheet();
+        for (int row = 0; row < READ_ROWS; ++row) {
+            for (int col = 0; col < READ_COLS; ++col) {
+                const Position pos{ row, col };
+                switch (col % 4) {
+                case 0:
+                    sheet->SetCell(pos, "text");
+                    break;
+                case 1:
+                    sheet->SetCell(pos, "'=escaped text that does not fit into a cell");
+                    break;
+                case 2:
+                    sheet->SetCell(pos, std::to_string(row));
+                    break;
+                default:
+                    sheet->SetCell(pos, "=" + Position{ row, col - 1 }.ToString() + "*2");
+                    break;
+                }
+            }
+        }
+        sheet->Recalculate();
+
+        constexpr int reads = READ_ROWS * READ_COLS * READ_PASSES;
+        auto print_allocations = [](MemoryUsage before, MemoryUsage after) {
+            std::cerr << "  allocations per read: "
+                << static_cast<double>(after.total_allocations - before.total_allocations) / reads << std::endl;
+        };
+        std::size_t text_size = 0;
+        {
+            const auto before = CurrentMemoryUsage();
+            {
+                LOG_DURATION("Read " + std::to_string(reads) + " values, GetValue");
+                for (int pass = 0; pass < READ_PASSES; ++pass) {
+                    for (int row = 0; row < READ_ROWS; ++row) {
+                        for (int col = 0; col < READ_COLS; ++col) {
+                            const auto value = sheet->GetCell({ row, col })->GetValue();
+                            if (std::holds_alternative<std::string>(value)) {
+                                text_size += std::get<std::string>(value).size();
+                            }
+                        }
+                    }
+                }
+            }
+            print_allocations(before, CurrentMemoryUsage());
+        }
+        {
+            const auto before = CurrentMemoryUsage();
+            {
+                LOG_DURATION("Read " + std::to_string(reads) + " values, GetValueView");
+                for (int pass = 0; pass < READ_PASSES; ++pass) {
+                    for (int row = 0; row < READ_ROWS; ++row) {
+                        for (int col = 0; col < READ_COLS; ++col) {
+                            const auto value = sheet->GetCell({ row, col })->GetValueView();
+                            if (std::holds_alternative<std::string_view>(value)) {
+                                text_size -= std::get<std::string_view>(value).size();
+                            }
+                        }
+                    }
+                }
+            }
+            print_allocations(before, CurrentMemoryUsage());
+        }
+        std::cerr << "  text size difference: " << text_size << std::endl;
+    }
+
+    constexpr int CLEARED_CELLS = 10000;
+
+    // Очистка ячеек диагонали с начала и с конца: каждая очистка меняет
+    // печатную область, а остальные ячейки её строки и столбца пусты.
+    void BenchmarkClearCells() {
+        for (const bool from_end : { false, true }) {
+            auto sheet = CreateSheet();
+            for (int i = 0; i < CLEARED_CELLS; ++i) {
+                sheet->SetCell({ i, i }, "x");
+            }
+            LOG_DURATION("Clear " + std::to_string(CLEARED_CELLS) + " diagonal cells, "
+                + (from_end ? "from the end" : "from the start"));
+            for (int i = 0; i < CLEARED_CELLS; ++i) {
+                const int index = from_end ? CLEARED_CELLS - 1 - i : i;
+                sheet->ClearCell({ index, index });
+            }
+        }
+    }
+
+    constexpr int QUERIED_FORMULAS = 100000;
+    constexpr int QUERY_PASSES = 10;
+
+    // Повторные запросы выражения и ссылок формул: выражение строится при
+    // первом запросе, дальше ни один запрос не выделяет память.
+    void BenchmarkFormulaQueries() {
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        for (int i = 0; i < QUERIED_FORMULAS; ++i) {
+            const Position pos{ i % READ_ROWS, i / READ_ROWS };
+            formulas.push_back(ParseFormula(pos.ToString() + "*2+SUM(" + pos.ToString() + ":B2)"));
+        }
+        std::size_t size = 0;
+        auto query = [&](int passes) {
+            for (int pass = 0; pass < passes; ++pass) {
+                for (const auto& formula : formulas) {
+                    size += formula->GetExpression().size() + formula->GetReferencedCells().size()
+                        + formula->GetReferencedRanges().size();
+                }
+            }
+        };
+        const std::string name = "Query " + std::to_string(QUERIED_FORMULAS) + " formulas";
+        for (const int passes : { 1, QUERY_PASSES }) {
+            std::size_t allocations = 0;
+            {
+                LOG_DURATION(name + ", " + std::to_string(passes) + " passes");
+                const auto before = CurrentMemoryUsage();
+                query(passes);
+                allocations = CurrentMemoryUsage().total_allocations - before.total_allocations;
+            }
+            std::cerr << "  allocations: " << allocations << std::endl;
+        }
+        std::cerr << "  total size: " << size << std::endl;
+    }
+
+    constexpr int LOAD_ROWS = 10000;
+    constexpr int LOAD_COLS = 100;
+
+    // Текст таблицы в формате PrintTexts(): числа, тексты и формулы, каждая
+    // из которых ссылается на ячейку слева.
+    std::string MakeLoadTexts() {
+        std::string texts;
+        for (int row = 0; row < LOAD_ROWS; ++row) {
+            for (int col = 0; col < LOAD_COLS; ++col) {
+                if (col > 0) {
+                    texts += '\t';
+                }
+                if (col % 10 == 9) {
+                    texts += "=" + Position{ row, col - 1 }.ToString() + "+1";
+                }
+                else if (col % 10 == 5) {
+                    texts += "'text";
+                }
+                else {
+                    texts += std::to_string(row * LOAD_COLS + col);
+                }
+            }
+            texts += '\n';
+        }
+        return texts;
+    }
+
+    void BenchmarkLoadTexts() {
+        const int cells = LOAD_ROWS * LOAD_COLS;
+        const std::string name = "Load " + std::to_string(cells) + " cells";
+        const std::string texts = MakeLoadTexts();
+        {
+            std::vector<std::pair<Position, std::string>> cell_texts;
+            auto sheet = CreateSheet();
+            const auto before = CurrentMemoryUsage();
+            ResetPeakMemoryUsage();
+            {
+                LOG_DURATION(name + ", split and SetCells");
+                std::istringstream input(texts);
+                std::string line;
+                for (int row = 0; std::getline(input, line); ++row) {
+                    std::istringstream fields(line);
+                    std::string field;
+                    for (int col = 0; std::getline(fields, field, '\t'); ++col) {
+                        cell_texts.emplace_back(Position{ row, col }, std::move(field));
+                    }
+                }
+                sheet->SetCells(std::move(cell_texts));
+            }
+            PrintMemoryUsage("  memory", before, CurrentMemoryUsage(), cells);
+            std::cerr << "  peak: " << (CurrentMemoryUsage().peak_bytes - before.bytes) / (1024 * 1024)
+                << " MiB" << std::endl;
+        }
+        {
+            auto sheet = CreateSheet();
+            const auto before = CurrentMemoryUsage();
+            ResetPeakMemoryUsage();
+            {
+                LOG_DURATION(name + ", LoadTexts");
+                std::istringstream input(texts);
+                sheet->LoadTexts(input, '\t');
+            }
+            PrintMemoryUsage("  memory", before, CurrentMemoryUsage(), cells);
+            std::cerr << "  peak: " << (CurrentMemoryUsage().peak_bytes - before.bytes) / (1024 * 1024)
+                << " MiB" << std::endl;
+        }
+    }
+
+    void PrintThroughput(std::size_t bytes, double seconds) {
+        std::cerr << "  " << bytes / (1024 * 1024) << " MiB, "
+            << static_cast<double>(bytes) / (1024 * 1024) / seconds << " MiB/s" << std::endl;
+    }
+
+    // Вывод таблицы из BenchmarkLoadTexts() по ячейкам, как до буферизации,
+    // и через буфер в поток и в файл.
+    void BenchmarkExport() {
+        auto sheet = CreateSheet();
+        std::istringstream input(MakeLoadTexts());
+        sheet->LoadTexts(input, '\t');
+        sheet->Recalculate();
+        const Size size = sheet->GetPrintableSize();
+        const std::string name = "Export " + std::to_string(size.rows * size.cols) + " values";
+
+        auto measure = [&](const std::string& title, auto print) {
+            const auto start = std::chrono::steady_clock::now();
+            std::size_t bytes = 0;
+            {
+                LOG_DURATION(name + ", " + title);
+                bytes = print();
+            }
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            PrintThroughput(bytes, elapsed.count());
+        };
+        measure("cell by cell", [&] {
+            std::ostringstream output;
+            for (int row = 0; row < size.rows; ++row) {
+                for (int col = 0; col < size.cols; ++col) {
+                    if (col > 0) {
+                        output << '\t';
+                    }
+                    if (const CellInterface* cell = sheet->GetCell({ row, col })) {
+                        std::visit([&output](const auto& value) {
+                            output << value;
+                        }, cell->GetValue());
+                    }
+                }
+                output << '\n';
+            }
+            return output.str().size();
+        });
+        measure("PrintValues to stream", [&] {
+            std::ostringstream output;
+            sheet->PrintValues(output);
+            return output.str().size();
+        });
+        measure("PrintValues to file", [&] {
+            std::FILE* file = std::tmpfile();
+            if (file == nullptr) {
+                return std::size_t{ 0 };
+            }
+            FileSink sink(file);
+            sheet->PrintValues(sink);
+            const auto bytes = static_cast<std::size_t>(std::ftell(file));
+            std::fclose(file);
+            return bytes;
+        });
+    }
+
+    // Готовая к работе таблица из BenchmarkLoadTexts(): загрузка текстов с
+    // разбором формул и пересчётом против загрузки снимка со значениями.
+    void BenchmarkSnapshot() {
+        const std::string texts = MakeLoadTexts();
+        auto source = CreateSheet();
+        std::istringstream source_input(texts);
+        source->LoadTexts(source_input, '\t');
+        source->Recalculate();
+        const Size size = source->GetPrintableSize();
+        const std::string name = "Restore " + std::to_string(size.rows * size.cols) + " cells";
+
+        std::string snapshot;
+        {
+            LOG_DURATION(name + ", SaveSnapshot");
+            std::ostringstream output;
+            StreamSink sink(output);
+            source->SaveSnapshot(sink, true);
+            snapshot = output.str();
+        }
+        std::cerr << "  texts: " << texts.size() / (1024 * 1024) << " MiB, snapshot: "
+            << snapshot.size() / (1024 * 1024) << " MiB" << std::endl;
+        source.reset();
+
+        {
+            LOG_DURATION(name + ", LoadTexts and Recalculate");
+            auto sheet = CreateSheet();
+            std::istringstream input(texts);
+            sheet->LoadTexts(input, '\t');
+            sheet->Recalculate();
+        }
+        {
+            LOG_DURATION(name + ", LoadSheetSnapshot");
+            auto sheet = LoadSheetSnapshot(snapshot);
+            sheet->Recalculate();
+        }
+    }
+}  // namespace
+
+// Замеры производительности. Результаты выводятся в std::cerr.
+int main() {
+    BenchmarkCellLayoutMemory();
+    BenchmarkFillOrder();
+    BenchmarkDiamondInvalidation();
+    BenchmarkRepeatedFormulaEdits();
+    BenchmarkFormulaEvaluation();
+    BenchmarkFormulaParsing();
+    BenchmarkFormulaSharing();
+    BenchmarkColumnTotal();
+    BenchmarkRangeDependencies();
+    BenchmarkChainLoad();
+    BenchmarkRecalculateChain();
+    BenchmarkErrorRecalculate();
+    BenchmarkParallelRecalculate();
+    BenchmarkNarrowParallelRecalculate();
+    BenchmarkBatchImport();
+    BenchmarkValueReads();
+    BenchmarkFormulaQueries();
+    BenchmarkClearCells();
+    BenchmarkLoadTexts();
+    BenchmarkExport();
+    BenchmarkSnapshot();
+    return 0;
+}
@@ -1,249 +1,229 @@
 #include "cell.h"
 
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <optional>
-#include <queue>
+#include <type_traits>
+
+static_assert(sizeof(Cell) <= 32, "Cell must stay compact");
 
 // Cell
-Cell::Cell()
-	: impl_(std::make_unique<EmptyImpl>()) {
+Cell::Cell() {
+	data_.header.kind = Kind::Empty;
 }
 
 Cell::Cell(Cell&& rhs) noexcept
-	: impl_(std::move(rhs.impl_)) {
+	: data_(rhs.data_) {
+	rhs.data_.header.kind = Kind::Empty;
 }
 
 Cell& Cell::operator=(Cell&& rhs) noexcept {
-	impl_ = std::move(rhs.impl_);
+	if (this != &rhs) {
+		Reset();
+		data_ = rhs.data_;
+		rhs.data_.header.kind = Kind::Empty;
+	}
 	return *this;
 }
 
-void Cell::Set(std::string text, Position pos, SheetInterface* sheet) {
-	if (!text.empty()) {
-		const char& c = text.front();
-		if (c == FORMULA_SIGN && text.size() > 1) {
-			try {
-				std::unique_ptr<FormulaInterface> formula = ParseFormula(text.substr(1));
-				impl_ = std::make_unique<FormulaImpl>(std::move(formula));
-			}
-			catch (FormulaException& fe) {
-				throw fe;
-			}
-		}
-		else {
-			impl_ = std::make_unique<TextImpl>(text);
-		}
+Cell::~Cell() {
+	Reset();
+}
+
+void Cell::Set(std::string_view text, Position pos, FormulaCache& formulas, const SheetInterface& sheet) {
+	if (text.empty()) {
+		Reset();
+		return;
 	}
-	else {
-		impl_ = std::make_unique<EmptyImpl>();
+	if (text.front() == FORMULA_SIGN && text.size() > 1) {
+		SetFormula(formulas.Parse(text.substr(1), pos), sheet);
 	}
-	impl_->SetSheet(sheet);
-	if (impl_->TestCyclicDependencies(pos)) {
-		throw CircularDependencyException("Circular Dependency!");
+	else if (text.size() <= SHORT_TEXT_CAPACITY) {
+		Reset();
+		data_.short_text.kind = Kind::ShortText;
+		data_.short_text.size = static_cast<std::uint8_t>(text.size());
+		std::memcpy(data_.short_text.data, text.data(), text.size());
+	}
+	else {
+		auto long_text = std::make_unique<std::string>(text);
+		Reset();
+		data_.long_text.kind = Kind::LongText;
+		data_.long_text.text = long_text.release();
 	}
-	impl_->SetParentForRefCells(pos);
-	impl_->InvalidateCache();
 }
 
 void Cell::Clear() {
-	Set("", impl_->GetPos(), impl_->GetSheet());
-}
-
-bool Cell::IsReferenced() const {
-	return !GetReferencedCells().empty();
-}
-
-void Cell::AddParent(Position pos) {
-	impl_->AddParent(pos);
-}
-
-bool Cell::HasParents() const {
-	return impl_->HasParents();
-}
-
-bool Cell::HasCach() const {
-	return impl_->HasCach();
-}
-
-void Cell::ClearCach() {
-	impl_->ClearCach();
-}
-
-std::vector<Position> Cell::GetParents() {
-	return impl_->GetParents();
-}
-
-Cell::Value Cell::GetValue() const {
-	return impl_->GetValue();
-}
-std::string Cell::GetText() const {
-	return impl_->GetText();
-}
-
-bool Cell::IsEmpty() const {
-	return impl_->GetText().empty();
+	Reset();
 }
 
-std::vector<Position> Cell::GetReferencedCells() const {
-	return impl_->GetReferencedCells();
+void Cell::SetFormula(std::unique_ptr<FormulaInterface> formula, const SheetInterface& sheet) {
+	auto data = std::make_unique<FormulaData>();
+	data->formula = std::move(formula);
+	data->sheet = &sheet;
+	Reset();
+	data_.formula.kind = Kind::Formula;
+	data_.formula.data = data.release();
 }
 
-// Common Impl
-bool Cell::Impl::IsReferenced() const {
-	return !GetReferencedCells().empty();
+const FormulaInterface* Cell::GetFormula() const {
+	return GetKind() == Kind::Formula ? data_.formula.data->formula.get() : nullptr;
 }
 
-std::vector<Position>& Cell::Impl::GetParents() {
-	return parent_cells_;
-}
-
-void Cell::Impl::AddParent(Position pos) {
-	parent_cells_.push_back(pos);
+void Cell::AttachCache(ValueCache& cache, std::size_t index) {
+	switch (GetKind()) {
+	case Kind::Empty:
+		cache.StoreEmpty(index);
+		break;
+	case Kind::ShortText:
+	case Kind::LongText: {
+		std::string_view text = GetTextView();
+		if (text.front() == ESCAPE_SIGN) {
+			text.remove_prefix(1);
+		}
+		cache.StoreText(index, text);
+		break;
+	}
+	case Kind::Formula:
+		data_.formula.data->cache = &cache;
+		data_.formula.data->cache_index = index;
+		cache.MarkStale(index);
+		break;
+	}
 }
 
-bool Cell::Impl::HasParents() const {
-	return !parent_cells_.empty();
+bool Cell::IsReferenced() const {
+	return GetKind() == Kind::Formula
+		&& (!GetReferencedCells().empty() || !GetReferencedRanges().empty());
 }
 
-bool Cell::Impl::HasCach() const {
-	if (std::holds_alternative<std::string>(cached_value_)) {
-		return !std::get<std::string>(cached_value_).empty();
+bool Cell::HasCach() const {
+	if (GetKind() == Kind::Formula) {
+		const FormulaData& formula = *data_.formula.data;
+		return formula.cache != nullptr && !formula.cache->IsStale(formula.cache_index);
 	}
 	return true;
 }
 
-void Cell::Impl::ClearCach() {
-	cached_value_ = Value{};
-}
-
-void Cell::Impl::SetSheet(SheetInterface* sheet) {
-	sheet_ptr_ = sheet;
-}
-
-const Position Cell::Impl::GetPos() const {
-	return pos_;
-}
-SheetInterface* Cell::Impl::GetSheet() {
-	return sheet_ptr_;
+void Cell::ClearCach() {
+	if (GetKind() == Kind::Formula && data_.formula.data->cache != nullptr) {
+		data_.formula.data->cache->MarkStale(data_.formula.data->cache_index);
+	}
 }
 
-
-void Cell::Impl::InvalidateCache() {
-	std::set<Position> visited_cells;
-	std::queue<Position> queue_;
-	for (const auto& parent_pos : parent_cells_) {
-		queue_.push(parent_pos);
-	}
-	while (!queue_.empty()) {
-		const auto& parent_pos = queue_.front();
-		Cell* parent_cell = static_cast<Cell*>(sheet_ptr_->GetCell(parent_pos));
-		if (parent_cell) {
-			if (parent_cell->HasParents()) {
-				for (const auto& parent_pos : parent_cell->GetParents()) {
-					queue_.push(parent_pos);
-				}
-			}
-			parent_cell->ClearCach();
+Cell::Value Cell::GetValue() const {
+	return std::visit([](auto value) {
+		if constexpr (std::is_same_v<decltype(value), std::string_view>) {
+			return Value(std::string(value));
+		}
+		else {
+			return Value(value);
 		}
-		queue_.pop();
+	}, GetValueView());
+}
+
+Cell::ValueView Cell::GetValueView() const {
+	switch (GetKind()) {
+	case Kind::Empty:
+		return std::string_view();
+	case Kind::ShortText:
+	case Kind::LongText: {
+		std::string_view text = GetTextView();
+		if (text.front() == ESCAPE_SIGN) {
+			text.remove_prefix(1);
+		}
+		return text;
 	}
-	ClearCach();
-}
-
-bool Cell::Impl::TestCyclicDependencies(Position pos) const {
-	if (IsReferenced()) {
-		std::queue<Position> queue_;
-		auto cell_childs = GetReferencedCells();
-		for (const auto& cell_pos : cell_childs) {
-			queue_.push(cell_pos);
+	case Kind::Formula: {
+		const FormulaData& formula = *data_.formula.data;
+		if (formula.cache == nullptr) {
+			return std::visit([](auto value) { return ValueView(value); },
+				formula.formula->Evaluate(*formula.sheet));
 		}
-		std::set<Position> visited_cells;
-		while (!queue_.empty()) {
-			const auto& child_pos = queue_.front();
-			if (!visited_cells.count(child_pos)) {
-				if (child_pos == pos) {
-					return true;
-				}
-				const Cell* child_cell = static_cast<const Cell*>(sheet_ptr_->GetCell(child_pos));
-				if (child_cell && child_cell->IsReferenced()) {
-					auto ref_cells = child_cell->GetReferencedCells();
-					for (const auto& ref_pos : ref_cells) {
-						queue_.push(ref_pos);
-					}
-				}
-				visited_cells.insert(child_pos);
+		ValueCache& cache = *formula.cache;
+		const std::size_t index = formula.cache_index;
+		if (cache.IsStale(index)) {
+			const auto value = formula.formula->Evaluate(*formula.sheet);
+			if (std::holds_alternative<double>(value)) {
+				cache.StoreNumber(index, std::get<double>(value));
+			}
+			else {
+				cache.StoreError(index, std::get<FormulaError>(value));
 			}
-			queue_.pop();
 		}
-	}
-	return false;
-}
-
-void Cell::Impl::SetParentForRefCells(Position pos) {
-	for (const auto& cell_pos : GetReferencedCells()) {
-		if (Cell* cell = static_cast<Cell*>(sheet_ptr_->GetCell(cell_pos))) {
-			cell->AddParent(pos);
+		if (cache.GetTag(index) == ValueCache::Tag::Number) {
+			return cache.GetNumber(index);
 		}
+		return cache.GetError(index);
+	}
 	}
+	assert(false);
+	return std::string_view();
 }
 
-// EmptyImpl
-Cell::Value Cell::EmptyImpl::GetValue() {
-	return Value("");
-}
-std::string Cell::EmptyImpl::GetText() const {
-	return "";
+std::string Cell::GetText() const {
+	if (GetKind() == Kind::Formula) {
+		return FORMULA_SIGN + data_.formula.data->formula->GetExpression();
+	}
+	return std::string(GetTextView());
 }
 
-std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const {
-	return {};
+void Cell::AppendText(std::string& output) const {
+	if (GetKind() == Kind::Formula) {
+		output += FORMULA_SIGN;
+		output += data_.formula.data->formula->GetExpression();
+	}
+	else {
+		output += GetTextView();
+	}
 }
 
-// TextImpl
-Cell::TextImpl::TextImpl(std::string text)
-	: value_(std::move(text)) {
+bool Cell::IsEmpty() const {
+	return GetKind() == Kind::Empty;
 }
 
-Cell::Value Cell::TextImpl::GetValue() {
-	char c = value_.front();
-	if (c == ESCAPE_SIGN) {
-		return value_.substr(1);
+const std::vector<Position>& Cell::GetReferencedCells() const {
+	static const std::vector<Position> no_cells;
+	if (GetKind() == Kind::Formula) {
+		return data_.formula.data->formula->GetReferencedCells();
 	}
-	return value_;
+	return no_cells;
 }
 
-std::string Cell::TextImpl::GetText() const {
-	return value_;
-}
-
-std::vector<Position> Cell::TextImpl::GetReferencedCells() const {
-	return {};
+const std::vector<Range>& Cell::GetReferencedRanges() const {
+	static const std::vector<Range> no_ranges;
+	if (GetKind() == Kind::Formula) {
+		return data_.formula.data->formula->GetReferencedRanges();
+	}
+	return no_ranges;
 }
 
-// FormulaImpl
-Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula)
-	: formula_(std::move(formula)) {
+Cell::Kind Cell::GetKind() const {
+	return data_.header.kind;
 }
 
-Cell::Value Cell::FormulaImpl::GetValue() {
-	if (!HasCach()) {
-		auto value = formula_->Evaluate(*sheet_ptr_);
-		if (std::holds_alternative<double>(value)) {
-			cached_value_ = std::get<double>(value);
-		}
-		else {
-			cached_value_ = std::get<FormulaError>(value);
-		}
+std::string_view Cell::GetTextView() const {
+	switch (GetKind()) {
+	case Kind::ShortText:
+		return { data_.short_text.data, data_.short_text.size };
+	case Kind::LongText:
+		return *data_.long_text.text;
+	default:
+		return {};
 	}
-	return cached_value_;
-}
-
-std::string Cell::FormulaImpl::GetText() const {
-	return FORMULA_SIGN + formula_->GetExpression();
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-	return formula_->GetReferencedCells();
+void Cell::Reset() {
+	switch (GetKind()) {
+	case Kind::LongText:
+		delete data_.long_text.text;
+		break;
+	case Kind::Formula:
+		delete data_.formula.data;
+		break;
+	default:
+		break;
+	}
+	data_.header.kind = Kind::Empty;
 }
\ No newline at end of file
@@ -2,7 +2,15 @@
 
 #include "common.h"
 #include "formula.h"
+#include "value_cache.h"
 
+#include <cstddef>
+#include <cstdint>
+
+// Ячейка хранится как компактное размеченное объединение: пустая ячейка и
+// короткий текст не требуют выделения памяти в куче. Позиция ячейки, таблица
+// и список зависимых ячеек хранятся в Sheet, а вычисленное значение - в кэше
+// значений блока таблицы, к которому ячейка привязывается после размещения.
 class Cell : public CellInterface {
 public:
     Cell();
@@ -10,83 +18,79 @@ public:
 
     Cell& operator=(Cell&& rhs) noexcept;
 
-    ~Cell() = default;
+    ~Cell();
 
     Value GetValue() const override;
+    ValueView GetValueView() const override;
     std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-
-    bool IsEmpty() const;
-    void Set(std::string text, Position pos, SheetInterface* sheet);
+    // Дописывает текст ячейки в output, не создавая промежуточной строки.
+    void AppendText(std::string& output) const;
+    bool IsEmpty() const override;
+    const std::vector<Position>& GetReferencedCells() const override;
+    const std::vector<Range>& GetReferencedRanges() const override;
+
+    // Задаёт текст ячейки pos; формула разбирается через formulas.
+    void Set(std::string_view text, Position pos, FormulaCache& formulas, const SheetInterface& sheet);
+    // Делает ячейку формулой, которая уже разобрана.
+    void SetFormula(std::unique_ptr<FormulaInterface> formula, const SheetInterface& sheet);
+    // Формула ячейки или nullptr, если ячейка не формула.
+    const FormulaInterface* GetFormula() const;
     void Clear();
 
+    // Привязывает ячейку к элементу index кэша значений и записывает туда её
+    // значение. Значение формулы считается устаревшим.
+    void AttachCache(ValueCache& cache, std::size_t index);
+
     bool IsReferenced() const;
-    void AddParent(Position pos);
-    bool HasParents() const;
     bool HasCach() const;
     void ClearCach();
-    std::vector<Position> GetParents();
 
 private:
-    class Impl {
-    public:
-        virtual Value GetValue() = 0;
-        virtual std::string GetText() const = 0;
-        virtual std::vector<Position> GetReferencedCells() const = 0;
-
-        virtual ~Impl() = default;
-
-        bool IsReferenced() const;
-        std::vector<Position>& GetParents();
-        void AddParent(Position pos);
-        bool HasParents() const;
-        bool HasCach() const;
-        void ClearCach();
-
-        void SetSheet(SheetInterface* sheet);
-
-        const Position GetPos() const;
-        SheetInterface* GetSheet();
-
-        void InvalidateCache();
-        bool TestCyclicDependencies(Position pos) const;
-        void SetParentForRefCells(Position pos);
-    protected:
-        SheetInterface* sheet_ptr_ = nullptr;
-        Position pos_;
-        std::vector<Position> parent_cells_;
-        Value cached_value_;
+    enum class Kind : std::uint8_t {
+        Empty,
+        ShortText,
+        LongText,
+        Formula,
     };
 
-    class EmptyImpl : public Impl {
-        Value GetValue() override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
+    struct FormulaData {
+        std::unique_ptr<FormulaInterface> formula;
+        const SheetInterface* sheet = nullptr;
+        ValueCache* cache = nullptr;
+        std::size_t cache_index = 0;
     };
 
-    class TextImpl : public Impl {
-    public:
-        TextImpl(std::string text);
+    static constexpr std::size_t SHORT_TEXT_CAPACITY = 22;
 
-        Value GetValue() override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
-
-    private:
-        std::string value_;
+    // Все варианты начинаются с поля kind, поэтому его можно читать через
+    // header независимо от активного члена объединения.
+    struct Header {
+        Kind kind;
+    };
+    struct ShortText {
+        Kind kind;
+        std::uint8_t size;
+        char data[SHORT_TEXT_CAPACITY];
+    };
+    struct LongText {
+        Kind kind;
+        std::string* text;
+    };
+    struct FormulaRef {
+        Kind kind;
+        FormulaData* data;
     };
 
-    class FormulaImpl : public Impl {
-    public:
-        FormulaImpl(std::unique_ptr<FormulaInterface> formula);
-
-        Value GetValue() override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
-
-    private:
-        std::unique_ptr<FormulaInterface> formula_;
+    union Data {
+        Header header;
+        ShortText short_text;
+        LongText long_text;
+        FormulaRef formula;
     };
 
-    std::unique_ptr<Impl> impl_;
+    Data data_;
+
+    Kind GetKind() const;
+    std::string_view GetTextView() const;
+    void Reset();
 };
\ No newline at end of file
@@ -2,9 +2,11 @@
 
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -26,6 +28,23 @@ struct Position {
     static const Position NONE;
 };
 
+// Прямоугольный диапазон ячеек, например A1:B3. Обе угловые ячейки входят в
+// диапазон; верхняя левая не правее и не ниже нижней правой.
+struct Range {
+    Position top_left;
+    Position bottom_right;
+
+    bool operator==(Range rhs) const;
+    bool operator<(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+
+    // Строит диапазон по двум противоположным углам в любом порядке.
+    static Range FromCorners(Position first, Position second);
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -76,11 +95,21 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Исключение, выбрасываемое при загрузке повреждённого или несовместимого
+// снимка таблицы
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // То же значение без копирования текста. Строка указывает в память
+    // ячейки и действительна, пока ячейка не изменена.
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -88,15 +117,35 @@ public:
     // В случае текстовой ячейки это её текст (без экранирующих символов). В
     // случае формулы - числовое значение формулы или сообщение об ошибке.
     virtual Value GetValue() const = 0;
+    // Возвращает видимое значение ячейки так же, как GetValue(), но не
+    // копирует текст и не выделяет память.
+    virtual ValueView GetValueView() const = 0;
     // Возвращает внутренний текст ячейки, как если бы мы начали её
     // редактирование. В случае текстовой ячейки это её текст (возможно,
     // содержащий экранирующие символы). В случае формулы - её выражение.
     virtual std::string GetText() const = 0;
+    // Проверяет, пуст ли текст ячейки. Не выделяет память.
+    virtual bool IsEmpty() const = 0;
 
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек. В случае текстовой ячейки список пуст.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // ячеек. В случае текстовой ячейки список пуст. Список хранится в ячейке
+    // и действителен, пока ячейка не изменена.
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны, на которые ссылается формула, без разложения на
+    // ячейки. Список отсортирован по возрастанию и не содержит повторяющихся
+    // диапазонов. В случае текстовой ячейки список пуст.
+    virtual const std::vector<Range>& GetReferencedRanges() const = 0;
+};
+
+// Приёмник текста, в который таблица выводит своё содержимое. Таблица
+// передаёт текст крупными блоками.
+class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+
+    virtual void Write(std::string_view data) = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -122,11 +171,40 @@ public:
     // начать текст со знака "=", но чтобы он не интерпретировался как формула.
     virtual void SetCell(Position pos, std::string text) = 0;
 
+    // Задаёт содержимое нескольких ячеек как одну операцию. Ячейки
+    // интерпретируются так же, как в SetCell(), но проверка циклических
+    // зависимостей и сброс кэша выполняются один раз для всего набора. Если
+    // какая-либо позиция или формула некорректна либо набор создаёт
+    // циклическую зависимость, бросается то же исключение, что и в SetCell(),
+    // и таблица не изменяется. Если позиция встречается несколько раз,
+    // действует последний текст.
+    virtual void SetCells(std::vector<std::pair<Position, std::string>> cells) = 0;
+
+    // Загружает ячейки из потока в формате PrintTexts(): строки таблицы
+    // разделяются переводом строки ("\r\n" тоже допускается), а столбцы -
+    // символом separator (для PrintTexts() - табуляцией). Первое поле потока
+    // попадает в ячейку A1. Пустые поля пропускаются, и соответствующие ячейки
+    // не изменяются. Непустые поля интерпретируются так же, как в SetCells(),
+    // и вся загрузка - одна операция: при ошибке таблица не изменяется.
+    virtual void LoadTexts(std::istream& input, char separator) = 0;
+
     // Возвращает значение ячейки.
     // Если ячейка пуста, может вернуть nullptr.
     virtual const CellInterface* GetCell(Position pos) const = 0;
     virtual CellInterface* GetCell(Position pos) = 0;
 
+    // Дописывает в numbers числовые значения непустых ячеек диапазона, как их
+    // видит формула; ячейки с пустым текстом пропускаются. Порядок значений
+    // не определён. Если значение какой-то ячейки нельзя трактовать как
+    // число, возвращает ошибку #VALUE!.
+    virtual std::optional<FormulaError> CollectNumbers(Range range,
+        std::vector<double>& numbers) const = 0;
+
+    // Возвращает значение ячейки так, как его видит формула: число, 0 для
+    // пустой ячейки или ячейки с пустым текстом либо ошибку #VALUE!, если
+    // значение нельзя трактовать как число.
+    virtual std::variant<double, FormulaError> GetNumber(Position pos) const = 0;
+
     // Очищает ячейку.
     // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
     // объект с пустым текстом.
@@ -141,9 +219,37 @@ public:
     // табуляции. После каждой строки выводится символ перевода строки. Для
     // преобразования ячеек в строку используются методы GetValue() или GetText()
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
+    // Числа выводятся с учётом настроек потока.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+    // То же в произвольный приёмник. Числа выводятся так же, как в поток с
+    // настройками по умолчанию.
+    virtual void PrintValues(OutputSink& output) const = 0;
+    virtual void PrintTexts(OutputSink& output) const = 0;
+
+    // Выводит в приёмник двоичный снимок таблицы: тексты ячеек и уже
+    // разобранные формулы со ссылками, а если with_values - ещё и вычисленные
+    // значения формул, которые не устарели. Снимок восстанавливается функцией
+    // LoadSheetSnapshot() без разбора формул. Числа записываются в порядке
+    // байтов платформы.
+    virtual void SaveSnapshot(OutputSink& output, bool with_values) const = 0;
+
+    // Вычисляет все формулы, значения которых устарели. Формулы вычисляются
+    // без рекурсии в топологическом порядке, каждая - ровно один раз, поэтому
+    // после вызова GetValue() не уходит вглубь даже для длинных цепочек ссылок.
+    virtual void Recalculate() = 0;
+
+    // Задаёт число потоков, на которых Recalculate() вычисляет независимые
+    // формулы. Результат не зависит от числа потоков. По умолчанию - 1.
+    virtual void SetRecalculationThreads(std::size_t thread_count) = 0;
 };
 
 // Создаёт готовую к работе пустую таблицу.
 std::unique_ptr<SheetInterface> CreateSheet();
+
+// Создаёт таблицу из снимка SheetInterface::SaveSnapshot(). Снимок читается
+// прямо из data, поэтому его можно отобразить в память из файла. Значения
+// формул, сохранённые в снимке, повторно не вычисляются.
+// Бросает SnapshotException, если снимок повреждён или записан на платформе
+// с другим порядком байтов.
+std::unique_ptr<SheetInterface> LoadSheetSnapshot(std::string_view data);
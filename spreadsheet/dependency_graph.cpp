@@ -0,0 +1,368 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+
+namespace {
+    auto LowerBound(const std::set<Position>& positions, Position pos) {
+        return positions.lower_bound(pos);
+    }
+
+    auto LowerBound(const std::vector<Position>& positions, Position pos) {
+        return std::lower_bound(positions.begin(), positions.end(), pos);
+    }
+
+    // Вызывает callback(pos) для каждой позиции из упорядоченного набора
+    // positions внутри range. Внутри строки позиции идут подряд; к следующей
+    // строке диапазона переходим поиском, поэтому строки без позиций не
+    // перебираются.
+    template <typename SortedPositions, typename Callback>
+    void ForEachPositionInRange(const SortedPositions& positions, Range range, Callback callback) {
+        auto pos_it = LowerBound(positions, range.top_left);
+        while (pos_it != positions.end() && pos_it->row <= range.bottom_right.row) {
+            if (pos_it->col < range.top_left.col) {
+                pos_it = LowerBound(positions, { pos_it->row, range.top_left.col });
+            }
+            else if (pos_it->col > range.bottom_right.col) {
+                pos_it = LowerBound(positions, { pos_it->row + 1, range.top_left.col });
+            }
+            else {
+                callback(*pos_it++);
+            }
+        }
+    }
+}  // namespace
+
+bool DependencyGraph::Node::IsIsolated() const {
+    return references.empty() && ranges.empty() && dependents.empty();
+}
+
+template <typename Predicate>
+bool DependencyGraph::IsReachable(Position from, Predicate is_target, std::int64_t max_order) const {
+    PositionSet visited_cells{ from };
+    std::vector<Position> stack{ from };
+    bool found = false;
+    while (!stack.empty() && !found) {
+        const Position cell_pos = stack.back();
+        stack.pop_back();
+        ForEachDependent(cell_pos, [&](Position dependent_pos) {
+            if (found || nodes_.at(dependent_pos).order > max_order
+                || !visited_cells.insert(dependent_pos).second) {
+                return;
+            }
+            if (is_target(dependent_pos)) {
+                found = true;
+                return;
+            }
+            stack.push_back(dependent_pos);
+        });
+    }
+    return found;
+}
+
+void DependencyGraph::SetReferences(Position pos, std::vector<Position> referenced_cells,
+    std::vector<Range> referenced_ranges) {
+    auto node_it = nodes_.find(pos);
+    if (node_it != nodes_.end()) {
+        for (const auto& ref_pos : node_it->second.references) {
+            nodes_.at(ref_pos).dependents.erase(pos);
+            EraseIfIsolated(ref_pos);
+        }
+        node_it->second.references.clear();
+        for (const auto& range : node_it->second.ranges) {
+            range_index_.Remove(range, pos);
+        }
+        node_it->second.ranges.clear();
+    }
+    if (referenced_cells.empty() && referenced_ranges.empty()) {
+        EraseIfIsolated(pos);
+        return;
+    }
+    Node& node = GetOrCreateNode(pos, false);
+    node.references = std::move(referenced_cells);
+    node.ranges = std::move(referenced_ranges);
+    for (const auto& ref_pos : node.references) {
+        Node& ref_node = GetOrCreateNode(ref_pos, true);
+        ref_node.dependents.insert(pos);
+        if (ref_node.order > node.order) {
+            Reorder(ref_pos, pos);
+        }
+    }
+    for (const auto& range : node.ranges) {
+        range_index_.Add(range, pos);
+        // Вершины, оказавшиеся внутри диапазона, должны стоять в порядке
+        // раньше pos. Порядок pos может измениться после каждого Reorder.
+        ForEachPositionInRange(node_positions_, range, [&](Position ref_pos) {
+            if (nodes_.at(ref_pos).order > node.order) {
+                Reorder(ref_pos, pos);
+            }
+        });
+    }
+}
+
+bool DependencyGraph::TrySetReferences(References new_references) {
+    std::vector<std::size_t> order;
+    if (!SortNewReferences(new_references, order)) {
+        return false;
+    }
+    // Сначала удаляются все прежние рёбра: иначе граф мог бы временно
+    // содержать цикл из старых и новых ссылок. Затем ячейки добавляются в
+    // найденном порядке, и новые рёбра не нарушают топологический порядок.
+    for (const auto& pos : new_references.positions) {
+        SetReferences(pos, {});
+    }
+    for (const auto index : order) {
+        SetReferences(new_references.positions[index],
+            std::move(new_references.referenced_cells[index]),
+            std::move(new_references.referenced_ranges[index]));
+    }
+    return true;
+}
+
+bool DependencyGraph::HasCycle(Position pos, const std::vector<Position>& referenced_cells,
+    const std::vector<Range>& referenced_ranges) const {
+    // Все новые рёбра ведут в pos, поэтому цикл появляется, только если одна
+    // из ячеек, на которые ссылается pos, уже зависит от pos. Зависимые от pos
+    // формулы стоят в порядке позже pos, поэтому достаточно искать путь к
+    // ячейкам, стоящим позже pos, и не заходить дальше самой поздней из них.
+    const Node* node = FindNode(pos);
+    if (node == nullptr && range_index_.Empty()) {
+        // От ячейки, которой нет в графе, никто не зависит.
+        return false;
+    }
+    // Если вершины pos нет, от неё зависят только формулы с диапазонами, и
+    // порядок не позволяет отсечь ни одну из ячеек.
+    const std::int64_t min_order = node ? node->order : std::numeric_limits<std::int64_t>::min();
+    std::int64_t max_order = min_order;
+    bool has_targets = false;
+    auto add_target = [&](Position ref_pos) {
+        const Node* ref_node = FindNode(ref_pos);
+        if (ref_node && ref_node->order > min_order) {
+            max_order = std::max(max_order, ref_node->order);
+            has_targets = true;
+        }
+    };
+    for (const auto& ref_pos : referenced_cells) {
+        if (ref_pos == pos) {
+            return true;
+        }
+        add_target(ref_pos);
+    }
+    for (const auto& range : referenced_ranges) {
+        if (range.Contains(pos)) {
+            return true;
+        }
+        ForEachPositionInRange(node_positions_, range, add_target);
+    }
+    if (!has_targets) {
+        return false;
+    }
+    return IsReachable(pos, [&](Position cell_pos) {
+        if (std::find(referenced_cells.begin(), referenced_cells.end(), cell_pos) != referenced_cells.end()) {
+            return true;
+        }
+        return std::any_of(referenced_ranges.begin(), referenced_ranges.end(), [cell_pos](const Range& range) {
+            return range.Contains(cell_pos);
+        });
+    }, max_order);
+}
+
+const std::vector<Position>& DependencyGraph::GetReferences(Position pos) const {
+    static const std::vector<Position> empty;
+    const Node* node = FindNode(pos);
+    return node ? node->references : empty;
+}
+
+const std::vector<Range>& DependencyGraph::GetReferencedRanges(Position pos) const {
+    static const std::vector<Range> empty;
+    const Node* node = FindNode(pos);
+    return node ? node->ranges : empty;
+}
+
+const DependencyGraph::Node* DependencyGraph::FindNode(Position pos) const {
+    auto node_it = nodes_.find(pos);
+    return node_it != nodes_.end() ? &node_it->second : nullptr;
+}
+
+DependencyGraph::Node& DependencyGraph::GetOrCreateNode(Position pos, bool is_reference) {
+    auto [node_it, inserted] = nodes_.try_emplace(pos);
+    if (inserted) {
+        // Ячейка внутри чужого диапазона уже имеет зависимые формулы, поэтому
+        // ей, как и ячейке, на которую ссылаются, место в начале порядка.
+        bool has_dependents = is_reference;
+        if (!has_dependents) {
+            range_index_.ForEachContaining(pos, [&has_dependents](Position) {
+                has_dependents = true;
+            });
+        }
+        node_it->second.order = has_dependents ? --min_order_ : ++max_order_;
+        node_positions_.insert(pos);
+    }
+    return node_it->second;
+}
+
+void DependencyGraph::EraseIfIsolated(Position pos) {
+    auto node_it = nodes_.find(pos);
+    if (node_it != nodes_.end() && node_it->second.IsIsolated()) {
+        nodes_.erase(node_it);
+        node_positions_.erase(pos);
+    }
+}
+
+bool DependencyGraph::SortNewReferences(const References& new_references,
+    std::vector<std::size_t>& order) const {
+    // Обход в глубину по графу, в котором ссылки ячеек набора уже заменены.
+    // Цикл есть, если обход возвращается в ячейку, которая ещё находится на
+    // стеке. Ячейки набора записываются в order при выходе из них.
+    enum class State : char {
+        NotVisited,
+        OnStack,
+        Done,
+    };
+    std::vector<State> batch_states(new_references.positions.size(), State::NotVisited);
+    std::unordered_map<Position, State, PositionHasher> other_states;
+    constexpr std::size_t NOT_IN_BATCH = static_cast<std::size_t>(-1);
+    auto find_index = [&](Position pos) {
+        auto index_it = new_references.indices.find(pos);
+        return index_it != new_references.indices.end() ? index_it->second : NOT_IN_BATCH;
+    };
+
+    // Ячейки набора могут оказаться внутри прежних или новых диапазонов, и
+    // тогда их нужно находить, даже если они ещё не вершины графа.
+    std::vector<Position> batch_positions;
+    const bool has_ranges = !range_index_.Empty()
+        || std::any_of(new_references.referenced_ranges.begin(), new_references.referenced_ranges.end(),
+            [](const std::vector<Range>& ranges) {
+                return !ranges.empty();
+            });
+    if (has_ranges) {
+        batch_positions = new_references.positions;
+        std::sort(batch_positions.begin(), batch_positions.end());
+    }
+
+    order.reserve(new_references.positions.size());
+    // В стеке хранятся позиция, её номер в наборе, ссылки, ячейки внутри
+    // диапазонов, на которые она ссылается, и номер следующей непросмотренной
+    // ссылки. Ячейки диапазонов просматриваются после отдельных ссылок.
+    struct Frame {
+        Position pos;
+        std::size_t index;
+        const std::vector<Position>* references;
+        std::vector<Position> range_cells;
+        std::size_t next_ref;
+    };
+    std::vector<Frame> stack;
+    auto push = [&](Position pos, std::size_t index) {
+        const bool in_batch = index != NOT_IN_BATCH;
+        const auto& references = in_batch ? new_references.referenced_cells[index] : GetReferences(pos);
+        const auto& ranges = in_batch ? new_references.referenced_ranges[index] : GetReferencedRanges(pos);
+        std::vector<Position> range_cells;
+        for (const auto& range : ranges) {
+            auto add_cell = [&range_cells](Position cell_pos) {
+                range_cells.push_back(cell_pos);
+            };
+            ForEachPositionInRange(node_positions_, range, add_cell);
+            ForEachPositionInRange(batch_positions, range, add_cell);
+        }
+        stack.push_back({ pos, index, &references, std::move(range_cells), 0 });
+    };
+    for (std::size_t start = 0; start < new_references.positions.size(); ++start) {
+        if (batch_states[start] != State::NotVisited) {
+            continue;
+        }
+        batch_states[start] = State::OnStack;
+        push(new_references.positions[start], start);
+        while (!stack.empty()) {
+            Frame& frame = stack.back();
+            const std::size_t reference_count = frame.references->size() + frame.range_cells.size();
+            if (frame.next_ref == reference_count) {
+                if (frame.index != NOT_IN_BATCH) {
+                    batch_states[frame.index] = State::Done;
+                    order.push_back(frame.index);
+                }
+                else {
+                    other_states[frame.pos] = State::Done;
+                }
+                stack.pop_back();
+                continue;
+            }
+            const Position ref_pos = frame.next_ref < frame.references->size()
+                ? (*frame.references)[frame.next_ref]
+                : frame.range_cells[frame.next_ref - frame.references->size()];
+            ++frame.next_ref;
+            const std::size_t ref_index = find_index(ref_pos);
+            State& state = ref_index != NOT_IN_BATCH ? batch_states[ref_index] : other_states[ref_pos];
+            if (state == State::OnStack) {
+                return false;
+            }
+            if (state == State::NotVisited) {
+                state = State::OnStack;
+                push(ref_pos, ref_index);
+            }
+        }
+    }
+    return true;
+}
+
+void DependencyGraph::Reorder(Position from, Position to) {
+    const std::int64_t lower_bound = nodes_.at(to).order;
+    const std::int64_t upper_bound = nodes_.at(from).order;
+
+    // Зависимые от to ячейки, которые стоят в порядке раньше from.
+    std::vector<Position> forward{ to };
+    PositionSet visited_cells{ to };
+    for (std::size_t i = 0; i < forward.size(); ++i) {
+        ForEachDependent(forward[i], [&](Position dependent_pos) {
+            if (nodes_.at(dependent_pos).order < upper_bound
+                && visited_cells.insert(dependent_pos).second) {
+                forward.push_back(dependent_pos);
+            }
+        });
+    }
+
+    // Ячейки, от которых зависит from и которые стоят в порядке позже to.
+    std::vector<Position> backward{ from };
+    visited_cells = { from };
+    auto add_backward = [&](Position ref_pos) {
+        if (nodes_.at(ref_pos).order > lower_bound
+            && visited_cells.insert(ref_pos).second) {
+            backward.push_back(ref_pos);
+        }
+    };
+    for (std::size_t i = 0; i < backward.size(); ++i) {
+        const Node& node = nodes_.at(backward[i]);
+        for (const auto& ref_pos : node.references) {
+            add_backward(ref_pos);
+        }
+        for (const auto& range : node.ranges) {
+            ForEachPositionInRange(node_positions_, range, add_backward);
+        }
+    }
+
+    auto by_order = [this](Position lhs, Position rhs) {
+        return nodes_.at(lhs).order < nodes_.at(rhs).order;
+    };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+
+    // Занятые участком номера раздаются заново: сначала ячейкам, от которых
+    // зависит from, затем ячейкам, зависящим от to.
+    std::vector<std::int64_t> orders;
+    orders.reserve(forward.size() + backward.size());
+    for (const auto& cell_pos : backward) {
+        orders.push_back(nodes_.at(cell_pos).order);
+    }
+    for (const auto& cell_pos : forward) {
+        orders.push_back(nodes_.at(cell_pos).order);
+    }
+    std::inplace_merge(orders.begin(), std::next(orders.begin(), backward.size()), orders.end());
+
+    auto order_it = orders.begin();
+    for (const auto& cell_pos : backward) {
+        nodes_.at(cell_pos).order = *order_it++;
+    }
+    for (const auto& cell_pos : forward) {
+        nodes_.at(cell_pos).order = *order_it++;
+    }
+}
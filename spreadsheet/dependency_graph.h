@@ -0,0 +1,109 @@
+#pragma once
+
+#include "common.h"
+#include "range_index.h"
+
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct PositionHasher {
+    std::size_t operator()(Position pos) const {
+        return static_cast<std::size_t>(pos.row) * Position::MAX_COLS + pos.col;
+    }
+};
+
+using PositionSet = std::unordered_set<Position, PositionHasher>;
+
+// Граф зависимостей между ячейками таблицы. Для каждой ячейки хранятся ячейки,
+// на которые ссылается её формула, и ячейки, формулы которых ссылаются на неё.
+// Рёбра хранятся по позициям, поэтому ссылки на ещё пустые ячейки тоже
+// учитываются. Вершина без рёбер удаляется из графа.
+//
+// Ссылка на диапазон хранится одним ребром-прямоугольником в RangeIndex и не
+// раскладывается на ячейки: ячейки диапазона не становятся вершинами графа, а
+// формулы, зависящие от ячейки через диапазоны, находятся запросом к индексу.
+//
+// Вершины поддерживаются в топологическом порядке (алгоритм Пирса-Келли):
+// ячейка всегда стоит в порядке раньше формул, которые на неё ссылаются.
+// Ребро, не нарушающее порядок, добавляется за O(1); иначе переупорядочивается
+// только участок графа между концами ребра.
+class DependencyGraph {
+public:
+    // Новые ссылки набора ячеек: referenced_cells[i] и referenced_ranges[i] -
+    // ссылки ячейки positions[i], indices - номер ячейки в наборе по её
+    // позиции.
+    struct References {
+        std::vector<Position> positions;
+        std::vector<std::vector<Position>> referenced_cells;
+        std::vector<std::vector<Range>> referenced_ranges;
+        std::unordered_map<Position, std::size_t, PositionHasher> indices;
+    };
+
+    // Заменяет списки ячеек и диапазонов, на которые ссылается ячейка pos.
+    // Прежние рёбра удаляются. Новые рёбра не должны образовывать цикл.
+    void SetReferences(Position pos, std::vector<Position> referenced_cells,
+        std::vector<Range> referenced_ranges = {});
+    // Заменяет ссылки сразу нескольких ячеек. Если новые ссылки образуют
+    // цикл, граф не изменяется и возвращается false.
+    bool TrySetReferences(References new_references);
+
+    // Проверяет, появится ли цикл, если ячейка pos станет ссылаться на
+    // referenced_cells и referenced_ranges.
+    bool HasCycle(Position pos, const std::vector<Position>& referenced_cells,
+        const std::vector<Range>& referenced_ranges = {}) const;
+
+    const std::vector<Position>& GetReferences(Position pos) const;
+    const std::vector<Range>& GetReferencedRanges(Position pos) const;
+
+    // Вызывает callback(dependent) для каждой формулы, которая ссылается на
+    // pos напрямую или через диапазон. Формула, ссылающаяся на pos несколькими
+    // способами, встречается несколько раз.
+    template <typename Callback>
+    void ForEachDependent(Position pos, Callback callback) const {
+        if (const Node* node = FindNode(pos)) {
+            for (const auto& dependent_pos : node->dependents) {
+                callback(dependent_pos);
+            }
+        }
+        range_index_.ForEachContaining(pos, callback);
+    }
+
+private:
+    struct Node {
+        std::vector<Position> references;
+        std::vector<Range> ranges;
+        PositionSet dependents;
+        std::int64_t order = 0;
+
+        bool IsIsolated() const;
+    };
+
+    std::unordered_map<Position, Node, PositionHasher> nodes_;
+    // Позиции вершин по возрастанию, чтобы находить вершины внутри диапазона.
+    std::set<Position> node_positions_;
+    RangeIndex range_index_;
+    // Новая вершина без рёбер может занять любое место в порядке: ячейке, на
+    // которую ссылаются, выгоднее встать в начало, а формуле - в конец.
+    std::int64_t min_order_ = 0;
+    std::int64_t max_order_ = 0;
+
+    const Node* FindNode(Position pos) const;
+    Node& GetOrCreateNode(Position pos, bool is_reference);
+    void EraseIfIsolated(Position pos);
+
+    // Упорядочивает ячейки new_references так, чтобы ячейка из набора шла
+    // раньше ссылающихся на неё формул. Возвращает false, если с учётом новых
+    // ссылок в графе есть цикл.
+    bool SortNewReferences(const References& new_references, std::vector<std::size_t>& order) const;
+    // Есть ли путь от from по рёбрам к зависимым ячейкам до ячейки, для
+    // которой is_target возвращает true. Обход не заходит в вершины с
+    // порядком больше max_order.
+    template <typename Predicate>
+    bool IsReachable(Position from, Predicate is_target, std::int64_t max_order) const;
+    // Восстанавливает порядок после добавления ребра from -> to, если
+    // from оказалась в порядке позже to.
+    void Reorder(Position from, Position to);
+};
@@ -3,6 +3,8 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <iterator>
+#include <mutex>
 #include <sstream>
 
 using namespace std::literals;
@@ -15,32 +17,55 @@ class Formula : public FormulaInterface {
 public:
     //   :
     explicit Formula(std::string expression) 
-        : ast_(ParseFormulaAST(expression)){
+        : Formula(std::make_shared<FormulaAST>(ParseFormulaAST(expression)), Position{}) {
     }
-    Value Evaluate(const SheetInterface& sheet) const override {
-        try {
-            return ast_.Execute(sheet);
+    //   ast    anchor.
+    //     ,    .
+    Formula(std::shared_ptr<const FormulaAST> ast, Position anchor)
+        : ast_(std::move(ast))
+        , anchor_(anchor) {
+        referenced_cells_.reserve(ast_->GetCells().size());
+        for (const Position cell : ast_->GetCells()) {
+            referenced_cells_.push_back(FormulaAST::ToAbsolute(cell, anchor_));
         }
-        catch (const FormulaError& fe) {
-            return { fe };
+        referenced_ranges_.reserve(ast_->GetRanges().size());
+        for (const Range range : ast_->GetRanges()) {
+            referenced_ranges_.push_back(FormulaAST::ToAbsolute(range, anchor_));
         }
     }
-    std::string GetExpression() const override {
-        std::ostringstream os;
-        ast_.PrintFormula(os);
-        return os.str();
+    Value Evaluate(const SheetInterface& sheet) const override {
+        return ast_->Execute(sheet, anchor_);
+    }
+    //       ,    
+    //  ,      .  
+    //   .
+    const std::string& GetExpression() const override {
+        std::call_once(expression_once_, [this] {
+            std::ostringstream os;
+            ast_->PrintFormula(os, anchor_);
+            expression_ = std::make_unique<const std::string>(os.str());
+        });
+        return *expression_;
     }
 
-    std::vector<Position> GetReferencedCells() const override {
-        auto cells_list = ast_.GetCells();
-        cells_list.unique();
-        if (!cells_list.empty()) {
-            return { cells_list.begin(), cells_list.end() };
-        }
-        return {};
+    const std::vector<Position>& GetReferencedCells() const override {
+        return referenced_cells_;
+    }
+
+    const std::vector<Range>& GetReferencedRanges() const override {
+        return referenced_ranges_;
+    }
+
+    void Save(std::string& output) const override {
+        ast_->Save(output, anchor_);
     }
 private:
-    FormulaAST ast_;
+    std::shared_ptr<const FormulaAST> ast_;
+    Position anchor_;
+    std::vector<Position> referenced_cells_;
+    std::vector<Range> referenced_ranges_;
+    mutable std::unique_ptr<const std::string> expression_;
+    mutable std::once_flag expression_once_;
 };
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
@@ -50,4 +75,49 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     catch (...) {
         throw FormulaException("Invalid Formula!");
     }
+}
+
+std::unique_ptr<FormulaInterface> LoadFormula(std::string_view& data) {
+    try {
+        return std::make_unique<Formula>(std::make_shared<FormulaAST>(FormulaAST::Load(data)), Position{});
+    }
+    catch (const ParsingError& error) {
+        throw FormulaException(error.what());
+    }
+}
+
+std::unique_ptr<FormulaInterface> FormulaCache::Parse(std::string_view expression, Position pos) {
+    try {
+        shape_.clear();
+        AppendFormulaShape(expression, pos, shape_);
+        auto shape_it = shapes_.find(shape_);
+        if (shape_it != shapes_.end()) {
+            if (auto ast = shape_it->second.lock()) {
+                return std::make_unique<Formula>(std::move(ast), pos);
+            }
+        }
+        auto ast = std::make_shared<const FormulaAST>(ParseFormulaAST(expression, pos));
+        if (shape_it != shapes_.end()) {
+            shape_it->second = ast;
+        }
+        else {
+            if (shapes_.size() >= purge_size_) {
+                for (auto it = shapes_.begin(); it != shapes_.end();) {
+                    it = it->second.expired() ? shapes_.erase(it) : std::next(it);
+                }
+                purge_size_ = std::max(MIN_PURGE_SIZE, 2 * shapes_.size());
+            }
+            shapes_.emplace(shape_, ast);
+        }
+        return std::make_unique<Formula>(std::move(ast), pos);
+    }
+    catch (...) {
+        throw FormulaException("Invalid Formula!");
+    }
+}
+
+std::size_t FormulaCache::GetShapeCount() const {
+    return std::count_if(shapes_.begin(), shapes_.end(), [](const auto& shape) {
+        return !shape.second.expired();
+    });
 }
\ No newline at end of file
@@ -4,12 +4,17 @@
 #include "FormulaAST.h"
 
 #include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 // ,      .
 //  :
 // *     , : 1+2*3, 2.5*(2+3.5/7)
 // *     : A1+B2*C3
+// *   SUM, MIN, MAX, AVERAGE, COUNT  ,  
+//  : SUM(A1:B3), MAX(A1:A5,C1*2)
 // ,   ,    ,   .  
 // ,    ,      . 
 //          .
@@ -27,14 +32,56 @@ public:
 
     //  ,   .
     //      .
-    virtual std::string GetExpression() const = 0;
+    //     ;    
+    // . ,     , ,   .
+    virtual const std::string& GetExpression() const = 0;
 
     //   ,     
     // .        
     // .
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
+
+    //  ,    ,  
+    // .       
+    //  .     
+    // GetReferencedCells(),      .
+    virtual const std::vector<Range>& GetReferencedRanges() const = 0;
+
+    //   output    ,   LoadFormula
+    //     .
+    virtual void Save(std::string& output) const = 0;
 };
 
 //       .
 //  FormulaException  ,    .
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+//  ,  FormulaInterface::Save,  
+//     data.
+//  FormulaException,   .
+std::unique_ptr<FormulaInterface> LoadFormula(std::string_view& data);
+
+//    ,      
+//  .      
+//      ,  =A1*B1  C1  =A2*B2  C2: 
+//    ,   -     
+// .          
+// ,     .
+class FormulaCache {
+public:
+    //  ,  ParseFormula(),    pos.
+    std::unique_ptr<FormulaInterface> Parse(std::string_view expression, Position pos);
+
+    //    ,    .
+    std::size_t GetShapeCount() const;
+
+private:
+    static constexpr std::size_t MIN_PURGE_SIZE = 1024;
+
+    //        ,  
+    //   ,    .
+    std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> shapes_;
+    std::size_t purge_size_ = MIN_PURGE_SIZE;
+    //   ;       .
+    std::string shape_;
+};
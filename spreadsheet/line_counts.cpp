@@ -0,0 +1,52 @@
+#include "line_counts.h"
+
+#include <cassert>
+
+namespace {
+    int HighestBit(std::uint64_t word) {
+        assert(word != 0);
+        int bit = 0;
+        for (int shift = 32; shift > 0; shift /= 2) {
+            if (word >> shift != 0) {
+                word >>= shift;
+                bit += shift;
+            }
+        }
+        return bit;
+    }
+}  // namespace
+
+void LineCounts::Increment(int index) {
+    const auto line = static_cast<std::size_t>(index);
+    if (line >= counts_.size()) {
+        counts_.resize(line + 1);
+        words_.resize(line / WORD_BITS + 1);
+        summary_.resize(line / (WORD_BITS * WORD_BITS) + 1);
+    }
+    if (counts_[line]++ == 0) {
+        words_[line / WORD_BITS] |= std::uint64_t{ 1 } << line % WORD_BITS;
+        summary_[line / (WORD_BITS * WORD_BITS)] |= std::uint64_t{ 1 } << line / WORD_BITS % WORD_BITS;
+    }
+}
+
+void LineCounts::Decrement(int index) {
+    const auto line = static_cast<std::size_t>(index);
+    assert(line < counts_.size() && counts_[line] > 0);
+    if (--counts_[line] == 0) {
+        std::uint64_t& word = words_[line / WORD_BITS];
+        word &= ~(std::uint64_t{ 1 } << line % WORD_BITS);
+        if (word == 0) {
+            summary_[line / (WORD_BITS * WORD_BITS)] &= ~(std::uint64_t{ 1 } << line / WORD_BITS % WORD_BITS);
+        }
+    }
+}
+
+int LineCounts::GetEnd() const {
+    for (std::size_t i = summary_.size(); i-- > 0;) {
+        if (summary_[i] != 0) {
+            const std::size_t word = i * WORD_BITS + HighestBit(summary_[i]);
+            return static_cast<int>(word * WORD_BITS + HighestBit(words_[word]) + 1);
+        }
+    }
+    return 0;
+}
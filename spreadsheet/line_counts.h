@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Счётчики непустых ячеек по номерам строк (или столбцов) таблицы. Кроме
+// счётчиков хранится двухуровневая битовая маска ненулевых счётчиков: бит
+// слова words_ отмечает строку, бит слова summary_ - непустое слово words_.
+// Поэтому изменение счётчика стоит O(1), а последняя непустая строка
+// находится просмотром не более чем MAX_ROWS / 4096 слов summary_ и одного
+// слова words_.
+class LineCounts {
+public:
+    void Increment(int index);
+    void Decrement(int index);
+
+    // Возвращает номер, следующий за последней строкой с ненулевым
+    // счётчиком, или 0, если таких строк нет.
+    int GetEnd() const;
+
+private:
+    static constexpr std::size_t WORD_BITS = 64;
+
+    // Массивы растут до наибольшего использованного номера.
+    std::vector<int> counts_;
+    std::vector<std::uint64_t> words_;
+    std::vector<std::uint64_t> summary_;
+};
@@ -1,7 +1,15 @@
 #include "common.h"
 #include "formula.h"
+#include "output_sink.h"
 #include "test_runner_p.h"
 
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <random>
+#include <sstream>
+
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
@@ -125,6 +133,73 @@ namespace {
         ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
     }
 
+    void TestSetCellFarCorner() {
+        auto sheet = CreateSheet();
+        const Position corner{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 };
+
+        sheet->SetCell(corner, "far");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ Position::MAX_ROWS, Position::MAX_COLS }));
+        ASSERT_EQUAL(sheet->GetCell(corner)->GetText(), "far");
+        ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+
+        sheet->SetCell("A1"_pos, "=XFD16384");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=XFD16384");
+
+        sheet->ClearCell(corner);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 1 }));
+        ASSERT(sheet->GetCell(corner) == nullptr);
+    }
+
+    void TestSetCellTextLengths() {
+        auto sheet = CreateSheet();
+        const std::string short_text = "twenty-two characters!";
+        const std::string long_text = "a text that does not fit into the cell itself";
+
+        sheet->SetCell("A1"_pos, short_text);
+        sheet->SetCell("A2"_pos, long_text);
+        sheet->SetCell("A3"_pos, "'" + long_text);
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), short_text);
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), long_text);
+        ASSERT_EQUAL(std::get<std::string>(sheet->GetCell("A3"_pos)->GetValue()), long_text);
+
+        sheet->SetCell("A2"_pos, short_text);
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), short_text);
+        sheet->SetCell("A1"_pos, "=A2");
+        sheet->SetCell("A1"_pos, long_text);
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), long_text);
+    }
+
+    void TestValueView() {
+        auto sheet = CreateSheet();
+        const std::string long_text = "a text that does not fit into the cell itself";
+        sheet->SetCell("A1"_pos, "short");
+        sheet->SetCell("A2"_pos, "'" + long_text);
+        sheet->SetCell("A3"_pos, "=1/0");
+        sheet->SetCell("A4"_pos, "=A5+1");
+        sheet->SetCell("A5"_pos, "'");
+        sheet->SetCell("B6"_pos, "x");
+
+        for (const auto& pos : { "A1"_pos, "A2"_pos, "A3"_pos, "A4"_pos, "A5"_pos, "A6"_pos }) {
+            const CellInterface* cell = sheet->GetCell(pos);
+            ASSERT(cell != nullptr);
+            const auto value = cell->GetValue();
+            const auto view = cell->GetValueView();
+            if (std::holds_alternative<std::string>(value)) {
+                ASSERT_EQUAL(std::get<std::string_view>(view), std::get<std::string>(value));
+            }
+            else if (std::holds_alternative<double>(value)) {
+                ASSERT_EQUAL(std::get<double>(view), std::get<double>(value));
+            }
+            else {
+                ASSERT_EQUAL(std::get<FormulaError>(view), std::get<FormulaError>(value));
+            }
+        }
+        ASSERT_EQUAL(std::get<std::string_view>(sheet->GetCell("A2"_pos)->GetValueView()), long_text);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A4"_pos)->GetValueView()), 1.0);
+        ASSERT(!sheet->GetCell("A5"_pos)->IsEmpty());
+        ASSERT(sheet->GetCell("A6"_pos)->IsEmpty());
+    }
+
     void TestClearCell() {
         auto sheet = CreateSheet();
 
@@ -136,6 +211,78 @@ namespace {
         sheet->ClearCell("J10"_pos);
     }
 
+    void TestEmptyTextCreatesNoChunk() {
+        // Внутри печатной области GetCell() возвращает nullptr только для
+        // ячейки, блок которой не создан.
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("ZZ5000"_pos, "2");
+        sheet->SetCell("M2500"_pos, "");
+        sheet->SetCells({ { "N2501"_pos, "" } });
+        ASSERT(sheet->GetCell("M2500"_pos) == nullptr);
+        ASSERT(sheet->GetCell("N2501"_pos) == nullptr);
+
+        // Блок, последняя непустая ячейка которого заменена пустым текстом,
+        // удаляется.
+        sheet->SetCell("M2500"_pos, "text");
+        ASSERT(sheet->GetCell("N2501"_pos) != nullptr);
+        sheet->SetCell("M2500"_pos, "");
+        ASSERT(sheet->GetCell("N2501"_pos) == nullptr);
+        sheet->SetCell("M2500"_pos, "=A1");
+        sheet->SetCells({ { "M2500"_pos, "" } });
+        ASSERT(sheet->GetCell("N2501"_pos) == nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 5000, 702 }));
+    }
+
+    void TestPrintableSizeRandomized() {
+        // Печатная область совпадает с прямоугольником, найденным перебором
+        // непустых ячеек; поле захватывает несколько блоков таблицы.
+        constexpr int SIDE = 150;
+        auto sheet = CreateSheet();
+        std::vector<char> non_empty(SIDE * SIDE);
+        std::mt19937 generator(7);
+        std::uniform_int_distribution<int> coordinate(0, SIDE - 1);
+        std::uniform_int_distribution<int> action(0, 3);
+        for (int step = 0; step < 20000; ++step) {
+            const Position pos{ coordinate(generator), coordinate(generator) };
+            switch (action(generator)) {
+            case 0:
+                sheet->SetCell(pos, "");
+                non_empty[pos.row * SIDE + pos.col] = false;
+                break;
+            case 1:
+                sheet->SetCell(pos, "text");
+                non_empty[pos.row * SIDE + pos.col] = true;
+                break;
+            default:
+                sheet->ClearCell(pos);
+                non_empty[pos.row * SIDE + pos.col] = false;
+                break;
+            }
+            if (step % 100 != 0) {
+                continue;
+            }
+            Size expected;
+            for (int row = 0; row < SIDE; ++row) {
+                for (int col = 0; col < SIDE; ++col) {
+                    if (non_empty[row * SIDE + col]) {
+                        expected.rows = std::max(expected.rows, row + 1);
+                        expected.cols = std::max(expected.cols, col + 1);
+                    }
+                }
+            }
+            ASSERT_EQUAL(sheet->GetPrintableSize(), expected);
+        }
+
+        // Пустой текст не расширяет печатную область.
+        sheet = CreateSheet();
+        sheet->SetCell("B2"_pos, "");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 0, 0 }));
+        sheet->SetCell("C3"_pos, "x");
+        sheet->SetCell("C3"_pos, "");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 0, 0 }));
+    }
+
     void TestFormulaArithmetic() {
         auto sheet = CreateSheet();
         auto evaluate = [&](std::string expr) {
@@ -179,6 +326,12 @@ namespace {
         ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
         ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
         ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+        // константы сворачиваются только при вычислении
+        ASSERT_EQUAL(reformat("A1*(60*60*24)"), "A1*60*60*24");
+        ASSERT_EQUAL(reformat("+(-(-B2))"), "+--B2");
+        ASSERT_EQUAL(reformat("2*A1+SUM(1,2)"), "2*A1+SUM(1,2)");
+        ASSERT_EQUAL(reformat("((1+A2)*3-4)/B5"), "((1+A2)*3-4)/B5");
+        ASSERT_EQUAL(reformat("(1-A2)-(3-B4)*5"), "1-A2-(3-B4)*5");
     }
 
     void TestFormulaReferencedCells() {
@@ -193,6 +346,24 @@ namespace {
         auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
         ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
         ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{ "A1"_pos, "A2"_pos, "A3"_pos }));
+
+        auto ranges = ParseFormula("SUM(C1:D2,A1:B2,C1:D2)+MAX(B2:A1)");
+        ASSERT(ranges->GetReferencedRanges()
+            == (std::vector<Range>{ { "A1"_pos, "B2"_pos }, { "C1"_pos, "D2"_pos } }));
+
+        // дерево длинной формулы не помещается в один блок памяти
+        std::string long_expression = "A1";
+        for (int i = 0; i < 500; ++i) {
+            long_expression += "+SUM(B" + std::to_string(i + 1) + ",-" + std::to_string(i) + ")";
+        }
+        auto long_formula = ParseFormula(long_expression);
+        ASSERT_EQUAL(long_formula->GetReferencedCells().size(), 501u);
+        std::string saved;
+        long_formula->Save(saved);
+        std::string_view saved_view = saved;
+        auto loaded = LoadFormula(saved_view);
+        ASSERT_EQUAL(loaded->GetExpression(), long_formula->GetExpression());
+        ASSERT_EQUAL(loaded->GetReferencedCells(), long_formula->GetReferencedCells());
     }
 
     void TestErrorValue() {
@@ -207,6 +378,32 @@ namespace {
             CellInterface::Value(FormulaError::Category::Value));
     }
 
+    void TestNumericText() {
+        // Текст трактуется как число по правилам std::strtod в локали "C".
+        auto sheet = CreateSheet();
+        auto evaluate = [&](const std::string& text) {
+            sheet->SetCell("A1"_pos, text);
+            sheet->SetCell("B1"_pos, "=A1");
+            return sheet->GetCell("B1"_pos)->GetValue();
+        };
+        ASSERT_EQUAL(evaluate("1.5"), CellInterface::Value(1.5));
+        ASSERT_EQUAL(evaluate("'1e3"), CellInterface::Value(1000.0));
+        ASSERT_EQUAL(evaluate(" \t2"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(evaluate("+3"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(evaluate("-.5"), CellInterface::Value(-0.5));
+        ASSERT_EQUAL(evaluate("0x1A"), CellInterface::Value(26.0));
+        ASSERT_EQUAL(evaluate("-0x1p-1"), CellInterface::Value(-0.5));
+        ASSERT_EQUAL(evaluate("'"), CellInterface::Value(0.0));
+        for (const char* text : { "1,5", "2 ", "--1", "+-1", "0x-1", "0x", "e5", " ", "12abc" }) {
+            ASSERT_EQUAL(evaluate(text), CellInterface::Value(FormulaError::Category::Value));
+        }
+
+        // Значение текстовой ячейки не меняется.
+        sheet->SetCell("A1"_pos, "'0x10");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value("0x10"));
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(16.0));
+    }
+
     void TestErrorDiv0() {
         auto sheet = CreateSheet();
 
@@ -252,7 +449,337 @@ namespace {
     void TestEmptyCellTreatedAsZero() {
         auto sheet = CreateSheet();
         sheet->SetCell("A1"_pos, "=B2");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0));
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    }
+
+    void TestFormulaBytecodeMatchesTree() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "2");
+        sheet->SetCell("A2"_pos, "text");
+        sheet->SetCell("A3"_pos, "");
+        sheet->SetCell("A4"_pos, "3.5");
+        sheet->SetCell("A5"_pos, "=1/0");
+
+        auto evaluate = [&](const FormulaAST& ast, bool use_tree) -> CellInterface::Value {
+            const auto value = use_tree ? ast.ExecuteTree(*sheet) : ast.Execute(*sheet);
+            if (std::holds_alternative<double>(value)) {
+                return std::get<double>(value);
+            }
+            return std::get<FormulaError>(value);
+        };
+
+        // Глубоко вложенная формула не помещается в буфер стека вычислений.
+        std::string nested = "1";
+        for (int i = 0; i < 100; ++i) {
+            nested = "A1-(" + nested + ")";
+        }
+
+        const std::vector<std::string> expressions = {
+            "1", "-A1", "+A4", "A1+A4*2", "(A1-A4)/A1", "-(A1+B7)*-A3",
+            "A2+1", "1+A2", "A1/A3", "A5+A2", "A2+A5", "1e+200*1e+200", nested,
+            "SUM(A1:A4)", "SUM(A1,A3:A4)*2", "AVERAGE(B1:B9)", "MAX(A1,SUM(A3:A4),-1)",
+            "COUNT(A1:A5)", "MIN(A4:A5)", "1+SUM(1e+308,1e+308)",
+            // свёртка констант
+            "A1*(60*60*24)", "+(-(-A4))", "--A1", "---A1", "2*A1", "2+A1*3", "2-A1", "2/A1", "A1/0",
+            "1/0", "1/0+A2", "A2+1/0", "-(1/0)", "A2*2", "2*A2", "1e+200*1e+200*A1", "A1*1e+200*1e+200",
+            "(1-1)*A1", "A1/(1-1)", "SUM(1,2,3)*A1", "AVERAGE(1,2)+A1", "MAX(1e+308,1e+308)*0",
+            "SUM(1,A1,2)", "SUM(A1:A4,1)", "MIN(1,-(2))", "COUNT(1/0)", "1+-A1+2*-(3*4)" };
+        for (const auto& expression : expressions) {
+            const auto ast = ParseFormulaAST(expression);
+            ASSERT_EQUAL(evaluate(ast, false), evaluate(ast, true));
+        }
+    }
+
+#ifdef SPREADSHEET_ANTLR_GENERATED
+    // Рукописный разбор должен принимать те же формулы, что и разбор ANTLR,
+    // и строить те же деревья. Формулы составляются из фрагментов
+    // грамматики, а часть из них затем портится. Тест запускается, только
+    // если разборщик ANTLR сгенерирован из Formula.g4 (SPREADSHEET_ANTLR_GENERATED).
+    void TestParserMatchesAntlr() {
+        auto parse = [](const std::string& expression, bool with_antlr) {
+            std::string saved;
+            try {
+                std::istringstream in(expression);
+                const auto ast = with_antlr ? ParseFormulaASTWithAntlr(in) : ParseFormulaAST(expression);
+                ast.Save(saved);
+            }
+            catch (...) {
+                return std::string("error");
+            }
+            std::ostringstream result;
+            result << std::hex;
+            for (const unsigned char byte : saved) {
+                result << static_cast<int>(byte) << ' ';
+            }
+            return result.str();
+        };
+        auto check = [&](const std::string& expression) {
+            const auto hand_written = parse(expression, false);
+            const auto antlr = parse(expression, true);
+            if (hand_written != antlr) {
+                std::cerr << "formula: " << expression << std::endl;
+            }
+            ASSERT_EQUAL(hand_written, antlr);
+        };
+
+        // Совпадение не должно сводиться к тому, что оба разбора всё отвергают.
+        for (const char* expression : { "1", "A1", "1+2*3-4/5", "-(-1)", "SUM(A1:B2)", "AVERAGE(COUNT(A1),1)" }) {
+            ASSERT(parse(expression, true) != "error");
+        }
+
+        for (const char* expression : { "", " ", "1", "1.", ".5", "1.5.5", "1e", "1e+", "1e-3", "2E+2",
+                 "1e400", "1e-400", "A1", "A0", "XFD16384", "XFE1", "A1B2", "SUM1+1", "MAX1", "SUMA(1)",
+                 "SUMMAX(1)", "sum(1)", "SUM()", "SUM(1,)", "SUM(A1:B2)", "SUM( A1 :\tB2 )", "A1:B2",
+                 "SUM(A1:B2+1)", "SUM(B2:A1,-A3)", "SUM(A1:A0)", "-(-1)", "+-+1", "((1))", "(1", "1)",
+                 "2*-3*4", "-1*2", "1-2-3", "1/2/3", "1-(2-3)", "1+2*3-4/5", "AVERAGE(COUNT(A1),1)" }) {
+            check(expression);
+        }
+
+        std::mt19937 generator(19);
+        auto random = [&](int size) {
+            return std::uniform_int_distribution<int>(0, size - 1)(generator);
+        };
+        const std::vector<std::string> atoms = { "1", "25", ".5", "3.25", "1e3", "2.5E-2", "A1", "B7",
+            "ZZ10", "A0", "XFE1" };
+        const std::vector<std::string> functions = { "SUM", "MIN", "MAX", "AVERAGE", "COUNT" };
+        const std::string ops = "+-*/";
+        const std::string spaces[] = { "", "", "", " ", "\t", "\r\n" };
+        std::function<std::string(int)> make_expression = [&](int depth) -> std::string {
+            const int kind = depth > 0 ? random(6) : 0;
+            switch (kind) {
+            case 0:
+                return atoms[random(static_cast<int>(atoms.size()))];
+            case 1:
+                return std::string(1, ops[random(2)]) + make_expression(depth - 1);
+            case 2:
+                return "(" + make_expression(depth - 1) + ")";
+            case 3: {
+                std::string result = functions[random(static_cast<int>(functions.size()))] + "(";
+                const int arg_count = 1 + random(3);
+                for (int i = 0; i < arg_count; ++i) {
+                    if (i > 0) {
+                        result += ',';
+                    }
+                    result += random(3) == 0 ? atoms[6 + random(5)] + ":" + atoms[6 + random(5)]
+                                             : make_expression(depth - 1);
+                }
+                return result + ")";
+            }
+            default:
+                return make_expression(depth - 1) + spaces[random(6)] + ops[random(4)] + spaces[random(6)]
+                    + make_expression(depth - 1);
+            }
+        };
+        const std::string noise = "A1Z9+-*/(),:.eE SUM";
+        for (int i = 0; i < 3000; ++i) {
+            std::string expression = make_expression(random(5));
+            if (i % 2 == 1) {
+                const int mutation_count = 1 + random(3);
+                for (int j = 0; j < mutation_count && !expression.empty(); ++j) {
+                    const auto pos = static_cast<std::size_t>(random(static_cast<int>(expression.size())));
+                    if (random(2) == 0) {
+                        expression.erase(pos, 1);
+                    }
+                    else {
+                        expression.insert(pos, 1, noise[random(static_cast<int>(noise.size()))]);
+                    }
+                }
+            }
+            check(expression);
+        }
+    }
+#endif
+
+    void TestFormulaSharing() {
+        FormulaCache formulas;
+        auto c1 = formulas.Parse("A1*B1", "C1"_pos);
+        auto c2 = formulas.Parse("A2 * B2", "C2"_pos);
+        auto d3 = formulas.Parse("SUM(A1:B2)+C2", "D3"_pos);
+        auto e4 = formulas.Parse("SUM(B2:C3)+D3", "E4"_pos);
+        ASSERT_EQUAL(formulas.GetShapeCount(), 2u);
+        ASSERT_EQUAL(c2->GetExpression(), "A2*B2");
+        ASSERT_EQUAL(c2->GetReferencedCells(), (std::vector<Position>{ "A2"_pos, "B2"_pos }));
+        ASSERT_EQUAL(e4->GetExpression(), "SUM(B2:C3)+D3");
+        ASSERT(e4->GetReferencedRanges() == (std::vector<Range>{ { "B2"_pos, "C3"_pos } }));
+
+        // Другое смещение ссылок или другой текст - другой вид формулы.
+        auto c3 = formulas.Parse("A1*B3", "C3"_pos);
+        auto c4 = formulas.Parse("A4*B4+0", "C4"_pos);
+        ASSERT_EQUAL(formulas.GetShapeCount(), 4u);
+        ASSERT_EQUAL(c3->GetReferencedCells(), (std::vector<Position>{ "A1"_pos, "B3"_pos }));
+        c3.reset();
+        c4.reset();
+        ASSERT_EQUAL(formulas.GetShapeCount(), 2u);
+
+        // Ссылки проверяются для каждой ячейки отдельно.
+        try {
+            formulas.Parse("A1", "A2"_pos);
+            formulas.Parse("A0", "A1"_pos);
+            ASSERT(false);
+        }
+        catch (const FormulaException&) {
+        }
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < 100; ++row) {
+            const std::string row_name = std::to_string(row + 1);
+            sheet->SetCell({ row, 0 }, std::to_string(row));
+            sheet->SetCell({ row, 1 }, "2");
+            sheet->SetCell({ row, 2 }, "=A" + row_name + "*B" + row_name);
+        }
+        ASSERT_EQUAL(sheet->GetCell("C10"_pos)->GetValue(), CellInterface::Value(18.0));
+        ASSERT_EQUAL(sheet->GetCell("C10"_pos)->GetText(), "=A10*B10");
+        sheet->SetCell("A10"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("C10"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT_EQUAL(sheet->GetCell("C11"_pos)->GetValue(), CellInterface::Value(20.0));
+    }
+
+    void TestFormulaFunctions() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "=A1*2");
+        sheet->SetCell("A3"_pos, "'4");
+        sheet->SetCell("B1"_pos, "10");
+        sheet->SetCell("B3"_pos, "");
+
+        auto evaluate = [&](const std::string& formula) {
+            sheet->SetCell("D1"_pos, formula);
+            return sheet->GetCell("D1"_pos)->GetValue();
+        };
+
+        // Пустые ячейки диапазона пропускаются.
+        ASSERT_EQUAL(evaluate("=SUM(A1:B3)"), CellInterface::Value(17.0));
+        ASSERT_EQUAL(evaluate("=COUNT(A1:B3)"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(evaluate("=AVERAGE(A1:A3)"), CellInterface::Value(7.0 / 3));
+        ASSERT_EQUAL(evaluate("=MIN(B3:A1,5)"), CellInterface::Value(1.0));
+        ASSERT_EQUAL(evaluate("=MAX(A1:A3)+MAX(C1:C9)"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(evaluate("=SUM(A1,A2*10,3)"), CellInterface::Value(24.0));
+        ASSERT_EQUAL(evaluate("=AVERAGE(C1:C9)"),
+            CellInterface::Value(FormulaError::Category::Div0));
+
+        sheet->SetCell("B2"_pos, "text");
+        ASSERT_EQUAL(evaluate("=SUM(A1:B3)"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("=SUM(A1:A3)"), CellInterface::Value(7.0));
+
+        // Диапазон хранится как прямоугольник и не раскладывается на ячейки.
+        sheet->SetCell("D1"_pos, "=SUM(B2:A1)+A1");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetText(), "=SUM(A1:B2)+A1");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetReferencedCells(), std::vector{ "A1"_pos });
+        ASSERT((sheet->GetCell("D1"_pos)->GetReferencedRanges()
+            == std::vector{ Range{ "A1"_pos, "B2"_pos } }));
+        sheet->SetCell("B2"_pos, "100");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(114.0));
+
+        try {
+            sheet->SetCell("A1"_pos, "=MAX(C1:D2)");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+
+        for (const char* incorrect : { "=A1:B2", "=SUM()", "=SUM(A1:)", "=FOO(A1)",
+            "=SUM(A1:B2:C3)", "=SUM(A1,)", "=SUM(A1:ZZZZ1)" }) {
+            try {
+                sheet->SetCell("E1"_pos, incorrect);
+                ASSERT(false);
+            }
+            catch (const FormulaException&) {
+            }
+        }
+    }
+
+    void TestRangeDependencies() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("D1"_pos, "=SUM(A1:A1000)");
+        sheet->SetCell("B1"_pos, "=MAX(A1:A10)*2");
+        sheet->SetCell("C1"_pos, "=B1+1");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(0.0));
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+        // Ячейки диапазона не были вершинами графа, но зависимые формулы
+        // находятся и сбрасывают кэш.
+        sheet->SetCell("A500"_pos, "5");
+        sheet->SetCell("A3"_pos, "=A500-4");
+        sheet->Recalculate();
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+        sheet->ClearCell("A500"_pos);
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(-7.0));
+
+        auto expect_cycle = [&](Position pos, const std::string& formula) {
+            try {
+                sheet->SetCell(pos, formula);
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException&) {
+            }
+        };
+        expect_cycle("A5"_pos, "=C1");
+        expect_cycle("A999"_pos, "=D1");
+        expect_cycle("A3"_pos, "=COUNT(A1:A4)");
+        expect_cycle("A500"_pos, "=SUM(C1:D1)");
+
+        // После замены формулы рёбра-диапазоны удаляются.
+        sheet->SetCell("D1"_pos, "1");
+        sheet->SetCell("A999"_pos, "=D1");
+        ASSERT_EQUAL(sheet->GetCell("A999"_pos)->GetValue(), CellInterface::Value(1.0));
+
+        try {
+            sheet->SetCells({ { "E1"_pos, "=SUM(F1:F2)" }, { "F2"_pos, "=E1" } });
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT(sheet->GetCell("E1"_pos) == nullptr);
+        // Ячейка набора без ссылок, которая не была вершиной графа, может
+        // замкнуть цикл через чужой диапазон.
+        try {
+            sheet->SetCells({ { "H1"_pos, "1" }, { "A7"_pos, "=C1" } });
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        sheet->SetCells({ { "E1"_pos, "=SUM(F1:F3)" }, { "F2"_pos, "=G1" }, { "G1"_pos, "3" } });
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(3.0));
+    }
+
+    void TestRangeAcrossChunks() {
+        // Диапазон пересекает границы блоков таблицы, а часть его ячеек -
+        // формулы, которые ещё не вычислены и ссылаются друг на друга.
+        auto sheet = CreateSheet();
+        constexpr int ROWS = 200;
+        double expected = 0.0;
+        for (int row = 0; row < ROWS; ++row) {
+            const Position pos{ row, 63 + row % 3 };
+            if (row % 10 == 9) {
+                sheet->SetCell(pos, "=" + Position{ row - 1, 63 + (row - 1) % 3 }.ToString() + "+1");
+                expected += row;
+            }
+            else {
+                sheet->SetCell(pos, std::to_string(row));
+                expected += row;
+            }
+        }
+        sheet->SetCell("A1"_pos, "=SUM(BL1:BN200)");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(expected));
+
+        sheet->SetCell("BN200"_pos, "'");
+        sheet->SetCell("BL200"_pos, "'5");
+        expected += 5;
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(expected));
+
+        sheet->SetCell("BL1"_pos, "=1/0");
+        ASSERT_EQUAL(sheet->GetCell("BL1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+
+        sheet->ClearCell("BL1"_pos);
+        sheet->SetCell("BM100"_pos, "1e3");
+        expected += 1000;
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(expected));
+        sheet->Recalculate();
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(expected));
     }
 
     void TestFormulaInvalidPosition() {
@@ -292,6 +819,67 @@ namespace {
         ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
     }
 
+    void TestPrintMatchesCellByCell() {
+        // Буферизованный вывод совпадает побайтно с выводом ячеек по одной,
+        // в том числе для пропусков из отсутствующих блоков таблицы.
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=1/3");
+        sheet->SetCell("C1"_pos, "'=escaped");
+        sheet->SetCell("B3"_pos, "=1/0");
+        sheet->SetCell("EZ3"_pos, "=123456789*10");
+        sheet->SetCell("BM70"_pos, "=-0.000012345");
+        sheet->SetCell("CA130"_pos, "a text that does not fit into the cell itself");
+        sheet->SetCell("D130"_pos, "=CA130");
+
+        auto print_cell_by_cell = [&](std::ostream& output, bool values) {
+            const Size size = sheet->GetPrintableSize();
+            for (int row = 0; row < size.rows; ++row) {
+                for (int col = 0; col < size.cols; ++col) {
+                    if (col > 0) {
+                        output << '\t';
+                    }
+                    if (const CellInterface* cell = sheet->GetCell({ row, col })) {
+                        if (values) {
+                            output << cell->GetValue();
+                        }
+                        else {
+                            output << cell->GetText();
+                        }
+                    }
+                }
+                output << '\n';
+            }
+        };
+        for (const bool values : { true, false }) {
+            std::ostringstream expected;
+            print_cell_by_cell(expected, values);
+            std::ostringstream output;
+            if (values) {
+                sheet->PrintValues(output);
+            }
+            else {
+                sheet->PrintTexts(output);
+            }
+            ASSERT_EQUAL(output.str(), expected.str());
+
+            std::ostringstream fixed_expected;
+            fixed_expected << std::fixed << std::setprecision(2);
+            print_cell_by_cell(fixed_expected, values);
+            std::ostringstream fixed_output;
+            fixed_output << std::fixed << std::setprecision(2);
+            if (values) {
+                sheet->PrintValues(fixed_output);
+            }
+            else {
+                sheet->PrintTexts(fixed_output);
+            }
+            ASSERT_EQUAL(fixed_output.str(), fixed_expected.str());
+        }
+        std::ostringstream values;
+        sheet->PrintValues(values);
+        ASSERT(values.str().find("0.333333\t\t=escaped") == 0);
+    }
+
     void TestCellReferences() {
         auto sheet = CreateSheet();
         sheet->SetCell("A1"_pos, "1");
@@ -314,6 +902,381 @@ namespace {
         ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{ "C3"_pos });
     }
 
+    void TestCacheInvalidationDiamond() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1");
+        sheet->SetCell("C1"_pos, "=A1+B1");
+        sheet->SetCell("D1"_pos, "=B1+C1");
+        sheet->SetCell("E1"_pos, "=C1*D1");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        sheet->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+        sheet->SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(54.0));
+
+        sheet->ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(0.0));
+    }
+
+    void TestDependenciesOnEmptyCells() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=B1+C1");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        sheet->SetCell("C1"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        sheet->SetCell("B1"_pos, "=C1*2");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(15.0));
+
+        sheet->SetCell("B1"_pos, "text");
+        sheet->SetCell("B1"_pos, "=C1");
+        sheet->SetCell("C1"_pos, "1");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        sheet->SetCell("A1"_pos, "=D1");
+        bool caught = false;
+        try {
+            sheet->SetCell("D1"_pos, "=A1");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        sheet->SetCell("A1"_pos, "=C1");
+        sheet->SetCell("D1"_pos, "=A1");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(1.0));
+    }
+
+    void TestRecalculateLongChain() {
+        constexpr int LENGTH = 100000;
+        constexpr int WIDTH = 100;
+        auto chain_pos = [](int index) {
+            return Position{ index / WIDTH, index % WIDTH };
+        };
+
+        auto sheet = CreateSheet();
+        sheet->SetCell(chain_pos(0), "1");
+        for (int i = 1; i < LENGTH; ++i) {
+            sheet->SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+        }
+        sheet->Recalculate();
+        ASSERT_EQUAL(sheet->GetCell(chain_pos(LENGTH - 1))->GetValue(), CellInterface::Value(double(LENGTH)));
+
+        sheet->SetCell(chain_pos(0), "=10");
+        sheet->Recalculate();
+        ASSERT_EQUAL(sheet->GetCell(chain_pos(LENGTH - 1))->GetValue(), CellInterface::Value(double(LENGTH + 9)));
+        ASSERT_EQUAL(sheet->GetCell(chain_pos(1))->GetValue(), CellInterface::Value(11.0));
+    }
+
+    void TestParallelRecalculateMatchesSerial() {
+        constexpr int ROWS = 60;
+        constexpr int COLS = 40;
+        auto serial = CreateSheet();
+        auto parallel = CreateSheet();
+        parallel->SetRecalculationThreads(4);
+
+        std::mt19937 generator(7);
+        std::uniform_int_distribution<int> col_distribution(0, COLS - 1);
+        std::uniform_int_distribution<int> op_distribution(0, 3);
+        const char ops[] = { '+', '-', '*', '/' };
+        for (int col = 0; col < COLS; ++col) {
+            const std::string text = std::to_string(col % 5);
+            serial->SetCell({ 0, col }, text);
+            parallel->SetCell({ 0, col }, text);
+        }
+        for (int row = 1; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                std::uniform_int_distribution<int> row_distribution(0, row - 1);
+                const Position lhs{ row_distribution(generator), col_distribution(generator) };
+                const Position rhs{ row_distribution(generator), col_distribution(generator) };
+                const std::string text = "=" + lhs.ToString() + ops[op_distribution(generator)] + rhs.ToString();
+                serial->SetCell({ row, col }, text);
+                parallel->SetCell({ row, col }, text);
+            }
+        }
+
+        auto check_same_values = [&] {
+            serial->Recalculate();
+            parallel->Recalculate();
+            std::ostringstream serial_values;
+            std::ostringstream parallel_values;
+            serial->PrintValues(serial_values);
+            parallel->PrintValues(parallel_values);
+            ASSERT_EQUAL(serial_values.str(), parallel_values.str());
+        };
+        check_same_values();
+
+        serial->SetCell({ 0, 3 }, "11");
+        parallel->SetCell({ 0, 3 }, "11");
+        check_same_values();
+    }
+
+    void TestSetCellsBatch() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=B1");
+        sheet->SetCells({ { "B1"_pos, "=A1" }, { "A1"_pos, "2" }, { "C1"_pos, "=A1+B1" } });
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "2");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+        sheet->SetCells({ { "A1"_pos, "3" }, { "A1"_pos, "5" } });
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        auto expect_unchanged = [&] {
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "5");
+            ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=A1");
+            ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 3 }));
+        };
+
+        bool caught = false;
+        try {
+            sheet->SetCells({ { "D1"_pos, "7" }, { "A1"_pos, "=C1" } });
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        expect_unchanged();
+
+        caught = false;
+        try {
+            sheet->SetCells({ { "D1"_pos, "7" }, { "A1"_pos, "=1+" } });
+        }
+        catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        expect_unchanged();
+
+        caught = false;
+        try {
+            sheet->SetCells({ { "D1"_pos, "7" }, { Position{ -1, 0 }, "1" } });
+        }
+        catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        expect_unchanged();
+
+        sheet->SetCells({ { "A1"_pos, "=D1" }, { "D1"_pos, "1" } });
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+    }
+
+    void TestLoadTexts() {
+        auto source = CreateSheet();
+        source->SetCell("A1"_pos, "text");
+        source->SetCell("C1"_pos, "'=escaped");
+        source->SetCell("A2"_pos, "=C3*2");
+        source->SetCell("B3"_pos, "a text that does not fit into the cell itself");
+        source->SetCell("C3"_pos, "21");
+        source->SetCell("D3"_pos, "=SUM(A2:A3,C3)");
+        std::ostringstream texts;
+        source->PrintTexts(texts);
+
+        auto sheet = CreateSheet();
+        std::istringstream input(texts.str());
+        sheet->LoadTexts(input, '\t');
+        std::ostringstream loaded_texts;
+        sheet->PrintTexts(loaded_texts);
+        ASSERT_EQUAL(loaded_texts.str(), texts.str());
+        ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetValue(), CellInterface::Value(63.0));
+
+        // Поля с разделителем-запятой и переводами строк "\r\n"; пустые поля
+        // не меняют ячейки. Формула A1 заменяется текстом, поэтому новая
+        // ссылка B1 на A1 не образует цикла.
+        sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=B1");
+        sheet->SetCell("C2"_pos, "kept");
+        input = std::istringstream("x,=A1\r\n,,\r\n,=B1+1,3");
+        sheet->LoadTexts(input, ',');
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "x");
+        ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetText(), "kept");
+        ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 3, 3 }));
+
+        // Строка длиннее буфера чтения.
+        const std::string long_text(100000, 'a');
+        input = std::istringstream("1\t" + long_text + "\t=A1+1\n2");
+        sheet->LoadTexts(input, '\t');
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), long_text);
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "2");
+
+        std::ostringstream before;
+        sheet->PrintTexts(before);
+        for (const char* incorrect : { "=B1\t=A1", "1\t=1+", "=C1" }) {
+            input = std::istringstream(incorrect);
+            try {
+                sheet->LoadTexts(input, '\t');
+                ASSERT(false);
+            }
+            catch (const FormulaException&) {
+            }
+            catch (const CircularDependencyException&) {
+            }
+            std::ostringstream after;
+            sheet->PrintTexts(after);
+            ASSERT_EQUAL(after.str(), before.str());
+        }
+    }
+
+    void TestSnapshot() {
+        auto source = CreateSheet();
+        source->SetCell("A1"_pos, "text");
+        source->SetCell("C1"_pos, "'=escaped");
+        source->SetCell("A2"_pos, "=+C3*2");
+        source->SetCell("B3"_pos, "a text that does not fit into the cell itself");
+        source->SetCell("C3"_pos, "21");
+        source->SetCell("D3"_pos, "=SUM(A2:A3,C3)-(-A2/2)");
+        source->SetCell("E3"_pos, "=MAX(1/0,2)");
+        source->SetCell("BM70"_pos, "=D3");
+        source->SetCell("A4"_pos, "=BM70+1");
+        source->Recalculate();
+        std::ostringstream texts;
+        source->PrintTexts(texts);
+        std::ostringstream values;
+        source->PrintValues(values);
+
+        for (const bool with_values : { true, false }) {
+            std::ostringstream snapshot;
+            StreamSink sink(snapshot);
+            source->SaveSnapshot(sink, with_values);
+            const std::string data = snapshot.str();
+
+            auto sheet = LoadSheetSnapshot(data);
+            std::ostringstream loaded_texts;
+            sheet->PrintTexts(loaded_texts);
+            ASSERT_EQUAL(loaded_texts.str(), texts.str());
+            std::ostringstream loaded_values;
+            sheet->PrintValues(loaded_values);
+            ASSERT_EQUAL(loaded_values.str(), values.str());
+            ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetReferencedCells(),
+                (std::vector<Position>{ "A2"_pos, "C3"_pos }));
+
+            // Зависимости восстановлены вместе с ячейками.
+            sheet->SetCell("C3"_pos, "1");
+            ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+            ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetValue(), CellInterface::Value(5.0));
+            try {
+                sheet->SetCell("C3"_pos, "=A4");
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException&) {
+            }
+
+            // Любой обрезанный снимок отвергается.
+            for (std::size_t size = 0; size < data.size(); ++size) {
+                try {
+                    LoadSheetSnapshot(std::string_view(data).substr(0, size));
+                    ASSERT(false);
+                }
+                catch (const SnapshotException&) {
+                }
+            }
+        }
+
+        std::ostringstream snapshot;
+        StreamSink sink(snapshot);
+        CreateSheet()->SaveSnapshot(sink, true);
+        auto empty = LoadSheetSnapshot(snapshot.str());
+        ASSERT_EQUAL(empty->GetPrintableSize(), (Size{ 0, 0 }));
+        for (const char* incorrect : { "", "not a snapshot", "SHTS" }) {
+            try {
+                LoadSheetSnapshot(incorrect);
+                ASSERT(false);
+            }
+            catch (const SnapshotException&) {
+            }
+        }
+    }
+
+    void TestDeeplyNestedFormula() {
+        constexpr int DEPTH = 100000;
+        auto isIncorrect = [](std::string expression) {
+            try {
+                ParseFormula(std::move(expression));
+            }
+            catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(isIncorrect(std::string(DEPTH, '-') + "1"));
+        ASSERT(isIncorrect(std::string(DEPTH, '(') + "1" + std::string(DEPTH, ')')));
+        ASSERT(isIncorrect("1" + std::string(DEPTH, ')')));
+        ASSERT(!isIncorrect(std::string(500, '-') + "(" + std::string(400, '(') + "A1" + std::string(401, ')')));
+        ASSERT(isIncorrect(std::string(600, '-') + "(" + std::string(400, '(') + "A1" + std::string(401, ')')));
+
+        // Плоская цепочка операций не ограничена по длине: её дерево
+        // обходится в цикле вдоль левой ветви.
+        constexpr int TERMS = 10000;
+        auto sheet = CreateSheet();
+        std::string long_sum = "A1";
+        for (int row = 1; row <= TERMS; ++row) {
+            sheet->SetCell({ row - 1, 0 }, std::to_string(row));
+            if (row > 1) {
+                long_sum += (row % 3 == 0 ? "-A" : "+A") + std::to_string(row);
+            }
+        }
+        auto sum_formula = ParseFormula(long_sum);
+        ASSERT_EQUAL(sum_formula->GetExpression(), long_sum);
+        ASSERT_EQUAL(sum_formula->GetReferencedCells().size(), static_cast<std::size_t>(TERMS));
+        std::string saved_sum;
+        sum_formula->Save(saved_sum);
+        std::string_view saved_sum_view = saved_sum;
+        auto loaded_sum = LoadFormula(saved_sum_view);
+        ASSERT_EQUAL(loaded_sum->GetExpression(), long_sum);
+        const double sum_value = std::get<double>(sum_formula->Evaluate(*sheet));
+        ASSERT_EQUAL(std::get<double>(loaded_sum->Evaluate(*sheet)), sum_value);
+        const auto sum_ast = ParseFormulaAST(long_sum);
+        ASSERT_EQUAL(std::get<double>(sum_ast.ExecuteTree(*sheet)), sum_value);
+        std::ostringstream sum_tree;
+        sum_ast.Print(sum_tree);
+        ASSERT_EQUAL(sum_tree.str().size(), long_sum.size() + 4 * (TERMS - 1));
+        sheet->SetCell({ TERMS, 0 }, "=" + long_sum);
+        ASSERT_EQUAL(sheet->GetCell({ TERMS, 0 })->GetValue(), CellInterface::Value(sum_value));
+
+        // Сохранённая формула -(-(...-(A1))) глубже допустимого отвергается
+        // при загрузке, в том числе из снимка таблицы.
+        std::string leaf;
+        ParseFormula("A1")->Save(leaf);
+        std::string negation;
+        ParseFormula("-A1")->Save(negation);
+        negation.resize(negation.size() - leaf.size());
+        std::string deep;
+        for (int i = 0; i < DEPTH; ++i) {
+            deep += negation;
+        }
+        deep += leaf;
+        try {
+            std::string_view data = deep;
+            LoadFormula(data);
+            ASSERT(false);
+        }
+        catch (const FormulaException&) {
+        }
+
+        auto source = CreateSheet();
+        source->SetCell("B1"_pos, "=-A1");
+        std::ostringstream snapshot;
+        StreamSink sink(snapshot);
+        source->SaveSnapshot(sink, false);
+        std::string data = snapshot.str();
+        const std::string saved = negation + leaf;
+        const auto formula_pos = data.find(saved);
+        ASSERT(formula_pos != std::string::npos);
+        data.replace(formula_pos, saved.size(), deep);
+        try {
+            LoadSheetSnapshot(data);
+            ASSERT(false);
+        }
+        catch (const SnapshotException&) {
+        }
+    }
+
     void TestFormulaIncorrect() {
         auto isIncorrect = [](std::string expression) {
             try {
@@ -350,6 +1313,78 @@ namespace {
         ASSERT(caught);
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
+
+    void TestCellCircularReferencesRandomized() {
+        constexpr int SIDE = 6;
+        auto sheet = CreateSheet();
+        std::mt19937 generator(42);
+        std::uniform_int_distribution<int> coordinate(0, SIDE - 1);
+        auto random_pos = [&] {
+            return Position{ coordinate(generator), coordinate(generator) };
+        };
+
+        auto depends_on = [&](Position from, Position to) {
+            std::vector<Position> stack{ from };
+            std::set<Position> visited;
+            while (!stack.empty()) {
+                Position pos = stack.back();
+                stack.pop_back();
+                if (pos == to) {
+                    return true;
+                }
+                if (!visited.insert(pos).second) {
+                    continue;
+                }
+                if (const CellInterface* cell = sheet->GetCell(pos)) {
+                    for (Position ref : cell->GetReferencedCells()) {
+                        stack.push_back(ref);
+                    }
+                    for (Range range : cell->GetReferencedRanges()) {
+                        for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+                            for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                                stack.push_back({ row, col });
+                            }
+                        }
+                    }
+                }
+            }
+            return false;
+        };
+
+        for (int i = 0; i < 2000; ++i) {
+            Position pos = random_pos();
+            std::vector<Position> refs{ random_pos(), random_pos() };
+            // Каждая третья формула ссылается на диапазон между двумя ячейками.
+            const bool use_range = i % 3 == 0;
+            std::string formula = "=" + refs[0].ToString() + "+" + refs[1].ToString();
+            if (use_range) {
+                const Range range = Range::FromCorners(refs[0], refs[1]);
+                formula = "=SUM(" + range.ToString() + ")";
+                refs.clear();
+                for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+                    for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                        refs.push_back({ row, col });
+                    }
+                }
+            }
+            bool expected_cycle = std::any_of(refs.begin(), refs.end(), [&](Position ref) {
+                return depends_on(ref, pos);
+            });
+
+            bool caught = false;
+            try {
+                sheet->SetCell(pos, formula);
+            }
+            catch (const CircularDependencyException&) {
+                caught = true;
+            }
+            ASSERT_EQUAL(caught, expected_cycle);
+
+            if (i % 7 == 0) {
+                sheet->ClearCell(random_pos());
+            }
+        }
+    }
 }  // namespace
 
 int main() {
@@ -360,18 +1395,44 @@ int main() {
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
+    RUN_TEST(tr, TestSetCellFarCorner);
+    RUN_TEST(tr, TestSetCellTextLengths);
+    RUN_TEST(tr, TestValueView);
     RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestEmptyTextCreatesNoChunk);
+    RUN_TEST(tr, TestPrintableSizeRandomized);
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
+    RUN_TEST(tr, TestNumericText);
     RUN_TEST(tr, TestErrorDiv0);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+    RUN_TEST(tr, TestFormulaBytecodeMatchesTree);
+#ifdef SPREADSHEET_ANTLR_GENERATED
+    RUN_TEST(tr, TestParserMatchesAntlr);
+#else
+    std::cerr << "TestParserMatchesAntlr SKIPPED: the ANTLR parser is not generated from Formula.g4" << std::endl;
+#endif
+    RUN_TEST(tr, TestFormulaFunctions);
+    RUN_TEST(tr, TestFormulaSharing);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestRangeAcrossChunks);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintMatchesCellByCell);
     RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestCacheInvalidationDiamond);
+    RUN_TEST(tr, TestDependenciesOnEmptyCells);
+    RUN_TEST(tr, TestRecalculateLongChain);
+    RUN_TEST(tr, TestParallelRecalculateMatchesSerial);
+    RUN_TEST(tr, TestSetCellsBatch);
+    RUN_TEST(tr, TestLoadTexts);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestDeeplyNestedFormula);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCellCircularReferencesRandomized);
     return 0;
 }
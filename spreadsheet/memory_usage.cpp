@@ -0,0 +1,85 @@
+#include "memory_usage.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Перед каждым блоком хранится его размер, чтобы при освобождении вычесть его
+// из счётчика занятой памяти.
+namespace {
+    constexpr std::size_t ALLOCATION_HEADER = alignof(std::max_align_t);
+
+    std::atomic<std::size_t> live_bytes{ 0 };
+    std::atomic<std::size_t> live_allocations{ 0 };
+    std::atomic<std::size_t> total_allocations{ 0 };
+    std::atomic<std::size_t> peak_bytes{ 0 };
+}  // namespace
+
+void* operator new(std::size_t size) {
+    void* block = std::malloc(size + ALLOCATION_HEADER);
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    *static_cast<std::size_t*>(block) = size;
+    const std::size_t bytes = live_bytes += size;
+    for (std::size_t peak = peak_bytes.load(); peak < bytes && !peak_bytes.compare_exchange_weak(peak, bytes);) {
+    }
+    ++live_allocations;
+    ++total_allocations;
+    return static_cast<char*>(block) + ALLOCATION_HEADER;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    void* block = static_cast<char*>(ptr) - ALLOCATION_HEADER;
+    live_bytes -= *static_cast<std::size_t*>(block);
+    --live_allocations;
+    std::free(block);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(size);
+    }
+    catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    operator delete(ptr);
+}
+
+MemoryUsage CurrentMemoryUsage() {
+    return { live_bytes.load(), live_allocations.load(), total_allocations.load(), peak_bytes.load() };
+}
+
+void ResetPeakMemoryUsage() {
+    peak_bytes = live_bytes.load();
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+
+// Объём памяти, выделенной через operator new и ещё не освобождённой, его
+// максимум с последнего вызова ResetPeakMemoryUsage() и общее число выделений
+// с начала работы программы.
+struct MemoryUsage {
+    std::size_t bytes = 0;
+    std::size_t allocations = 0;
+    std::size_t total_allocations = 0;
+    std::size_t peak_bytes = 0;
+};
+
+MemoryUsage CurrentMemoryUsage();
+void ResetPeakMemoryUsage();
@@ -0,0 +1,22 @@
+#include "output_sink.h"
+
+#include <ostream>
+#include <stdexcept>
+
+StreamSink::StreamSink(std::ostream& output)
+    : output_(output) {
+}
+
+void StreamSink::Write(std::string_view data) {
+    output_.write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+
+FileSink::FileSink(std::FILE* file)
+    : file_(file) {
+}
+
+void FileSink::Write(std::string_view data) {
+    if (std::fwrite(data.data(), 1, data.size(), file_) != data.size()) {
+        throw std::runtime_error("Failed to write output");
+    }
+}
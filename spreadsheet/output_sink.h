@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdio>
+#include <iosfwd>
+
+// Передаёт данные в поток std::ostream.
+class StreamSink : public OutputSink {
+public:
+    explicit StreamSink(std::ostream& output);
+
+    void Write(std::string_view data) override;
+
+private:
+    std::ostream& output_;
+};
+
+// Записывает данные в файл C напрямую, без форматирования потока. Если файлу
+// отключить буферизацию (setvbuf с _IONBF), каждый блок уходит в файловый
+// дескриптор одним вызовом записи.
+class FileSink : public OutputSink {
+public:
+    explicit FileSink(std::FILE* file);
+
+    // Бросает std::runtime_error, если данные не удалось записать.
+    void Write(std::string_view data) override;
+
+private:
+    std::FILE* file_;
+};
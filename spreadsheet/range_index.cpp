@@ -0,0 +1,32 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+bool RangeIndex::Edge::operator==(const Edge& rhs) const {
+    return range == rhs.range && dependent == rhs.dependent;
+}
+
+void RangeIndex::Add(Range range, Position dependent) {
+    ForEachVertex(range, [&](std::size_t vertex) {
+        buckets_[vertex].push_back({ range, dependent });
+    });
+    ++edge_count_;
+}
+
+void RangeIndex::Remove(Range range, Position dependent) {
+    const Edge edge{ range, dependent };
+    ForEachVertex(range, [&](std::size_t vertex) {
+        auto bucket_it = buckets_.find(vertex);
+        assert(bucket_it != buckets_.end());
+        auto& edges = bucket_it->second;
+        auto edge_it = std::find(edges.begin(), edges.end(), edge);
+        assert(edge_it != edges.end());
+        *edge_it = edges.back();
+        edges.pop_back();
+        if (edges.empty()) {
+            buckets_.erase(bucket_it);
+        }
+    });
+    --edge_count_;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+// Индекс рёбер-диапазонов: для каждой формулы хранятся прямоугольники, на
+// которые она ссылается, а запрос по позиции находит все формулы, чьи
+// диапазоны её содержат.
+//
+// Индекс - дерево отрезков по строкам. Диапазон строк раскладывается не
+// более чем на 2 * log(MAX_ROWS) вершин дерева, и ребро запоминается только в
+// них, поэтому память растёт с числом рёбер, а не с площадью диапазонов.
+// Запрос проходит путь от листа строки к корню и проверяет у найденных рёбер
+// столбцы.
+class RangeIndex {
+public:
+    struct Edge {
+        Range range;
+        Position dependent;
+
+        bool operator==(const Edge& rhs) const;
+    };
+
+    void Add(Range range, Position dependent);
+    void Remove(Range range, Position dependent);
+
+    bool Empty() const {
+        return edge_count_ == 0;
+    }
+
+    // Вызывает callback(dependent) для каждого ребра, диапазон которого
+    // содержит pos. Формула, несколько диапазонов которой содержат pos,
+    // встречается несколько раз.
+    template <typename Callback>
+    void ForEachContaining(Position pos, Callback callback) const {
+        if (Empty()) {
+            return;
+        }
+        for (std::size_t vertex = LEAF_COUNT + pos.row; vertex > 0; vertex /= 2) {
+            auto bucket_it = buckets_.find(vertex);
+            if (bucket_it == buckets_.end()) {
+                continue;
+            }
+            for (const Edge& edge : bucket_it->second) {
+                if (edge.range.top_left.col <= pos.col && pos.col <= edge.range.bottom_right.col) {
+                    callback(edge.dependent);
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr std::size_t LEAF_COUNT = Position::MAX_ROWS;
+    static_assert((LEAF_COUNT & (LEAF_COUNT - 1)) == 0, "the number of rows must be a power of two");
+
+    // Вершины дерева нумеруются как в двоичной куче: корень - 1, листья -
+    // LEAF_COUNT + row. Хранятся только непустые вершины.
+    std::unordered_map<std::size_t, std::vector<Edge>> buckets_;
+    std::size_t edge_count_ = 0;
+
+    // Вызывает callback(vertex) для вершин, на которые раскладывается
+    // диапазон строк range.
+    template <typename Callback>
+    static void ForEachVertex(Range range, Callback callback) {
+        std::size_t left = LEAF_COUNT + range.top_left.row;
+        std::size_t right = LEAF_COUNT + range.bottom_right.row + 1;
+        for (; left < right; left /= 2, right /= 2) {
+            if (left % 2 == 1) {
+                callback(left++);
+            }
+            if (right % 2 == 1) {
+                callback(--right);
+            }
+        }
+    }
+};
@@ -2,13 +2,22 @@
 
 #include "cell.h"
 #include "common.h"
+#include "output_sink.h"
+#include "task_graph.h"
 
 #include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <locale>
 #include <optional>
-#include <queue>
-#include <set>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
 
 using namespace std::literals;
 
@@ -19,19 +28,109 @@ void Sheet::SetCell(Position pos, std::string text) {
         throw InvalidPositionException("Wrong position!"s);
     }
     Cell cell;
-    cell.Set(text, pos, this);
-    if (size_.rows <= pos.row) {
-        sheet_.resize(pos.row + 1);
-        sheet_[pos.row].resize(size_.cols);
-        size_.rows = pos.row + 1;
+    cell.Set(text, pos, formulas_, *this);
+    const auto& referenced_cells = cell.GetReferencedCells();
+    const auto& referenced_ranges = cell.GetReferencedRanges();
+    if (graph_.HasCycle(pos, referenced_cells, referenced_ranges)) {
+        throw CircularDependencyException("Circular Dependency!");
     }
-    if (size_.cols <= pos.col) {
-        for (auto& row : sheet_) {
-            row.resize(pos.col + 1);
-            size_.cols = pos.col + 1;
+    graph_.SetReferences(pos, referenced_cells, referenced_ranges);
+    PlaceCell(pos, std::move(cell));
+    InvalidateCache({ pos });
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    for (const auto& [pos, text] : cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Wrong position!"s);
+        }
+    }
+    // Если позиция встречается несколько раз, действует последний текст.
+    std::unordered_map<Position, std::size_t, PositionHasher> indices;
+    std::vector<std::pair<Position, Cell>> new_cells;
+    new_cells.reserve(cells.size());
+    for (const auto& [pos, text] : cells) {
+        Cell cell;
+        cell.Set(text, pos, formulas_, *this);
+        auto [index_it, inserted] = indices.emplace(pos, new_cells.size());
+        if (inserted) {
+            new_cells.emplace_back(pos, std::move(cell));
+        }
+        else {
+            new_cells[index_it->second].second = std::move(cell);
         }
     }
-    sheet_[pos.row][pos.col] = std::move(cell);
+    ApplyCells(std::move(new_cells));
+}
+
+namespace {
+    constexpr std::size_t LOAD_BUFFER_SIZE = 1 << 16;
+
+    // Вызывает callback(pos, field) для каждого поля потока. Поток читается
+    // блоками в буфер, а неполная последняя строка блока переносится в начало
+    // буфера, поэтому память не зависит от размера потока, если строки
+    // короче буфера.
+    template <typename Callback>
+    void ForEachField(std::istream& input, char separator, Callback callback) {
+        int row = 0;
+        auto parse_line = [&](std::string_view line) {
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            int col = 0;
+            while (true) {
+                const auto field_end = line.find(separator);
+                callback(Position{ row, col }, line.substr(0, field_end));
+                if (field_end == std::string_view::npos) {
+                    break;
+                }
+                line.remove_prefix(field_end + 1);
+                ++col;
+            }
+            ++row;
+        };
+
+        std::string buffer(LOAD_BUFFER_SIZE, '\0');
+        std::size_t filled = 0;
+        while (true) {
+            input.read(buffer.data() + filled, static_cast<std::streamsize>(buffer.size() - filled));
+            filled += static_cast<std::size_t>(input.gcount());
+            const std::string_view data(buffer.data(), filled);
+            std::size_t line_begin = 0;
+            for (auto line_end = data.find('\n'); line_end != std::string_view::npos;
+                line_end = data.find('\n', line_begin)) {
+                parse_line(data.substr(line_begin, line_end - line_begin));
+                line_begin = line_end + 1;
+            }
+            if (!input) {
+                if (line_begin < filled) {
+                    parse_line(data.substr(line_begin));
+                }
+                break;
+            }
+            std::copy(buffer.begin() + line_begin, buffer.begin() + filled, buffer.begin());
+            filled -= line_begin;
+            if (filled == buffer.size()) {
+                buffer.resize(buffer.size() * 2);
+            }
+        }
+    }
+}  // namespace
+
+void Sheet::LoadTexts(std::istream& input, char separator) {
+    std::vector<std::pair<Position, Cell>> cells;
+    ForEachField(input, separator, [&](Position pos, std::string_view field) {
+        if (field.empty()) {
+            return;
+        }
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Wrong position!"s);
+        }
+        Cell cell;
+        cell.Set(field, pos, formulas_, *this);
+        cells.emplace_back(pos, std::move(cell));
+    });
+    ApplyCells(std::move(cells));
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -42,23 +141,91 @@ CellInterface* Sheet::GetCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Wrong position!"s);
     }
-    if (pos < Position{ size_.rows, size_.cols }) {
-        return &sheet_[pos.row][pos.col];
+    if (pos.row < size_.rows && pos.col < size_.cols) {
+        return FindCell(pos);
     }
     else {
         return nullptr;
     }
 }
 
+std::optional<FormulaError> Sheet::CollectNumbers(Range range,
+    std::vector<double>& numbers) const {
+    const int top = range.top_left.row;
+    const int bottom = std::min(range.bottom_right.row, size_.rows - 1);
+    const int left = range.top_left.col;
+    const int right = std::min(range.bottom_right.col, size_.cols - 1);
+    for (int chunk_top = top / CHUNK_SIZE * CHUNK_SIZE; chunk_top <= bottom; chunk_top += CHUNK_SIZE) {
+        for (int chunk_left = left / CHUNK_SIZE * CHUNK_SIZE; chunk_left <= right; chunk_left += CHUNK_SIZE) {
+            auto chunk_it = chunks_.find(ChunkIndex({ chunk_top, chunk_left }));
+            if (chunk_it == chunks_.end()) {
+                continue;
+            }
+            const Chunk& chunk = *chunk_it->second;
+            const int row_begin = std::max(top, chunk_top) - chunk_top;
+            const int row_end = std::min(bottom, chunk_top + CHUNK_SIZE - 1) - chunk_top + 1;
+            const int col_begin = std::max(left, chunk_left) - chunk_left;
+            const int col_end = std::min(right, chunk_left + CHUNK_SIZE - 1) - chunk_left + 1;
+            const std::uint64_t rows = ValueCache::RowMask(row_begin, row_end);
+            for (int col = col_begin; col < col_end; ++col) {
+                // Сначала вычисляются устаревшие формулы столбца, затем его
+                // значения читаются из кэша подряд.
+                const std::uint64_t stale = chunk.values.GetStaleRows(col) & rows;
+                for (int row = row_begin; stale != 0 && row < row_end; ++row) {
+                    if (stale >> row & 1) {
+                        chunk.cells[CellIndex({ chunk_top + row, chunk_left + col })].GetValueView();
+                    }
+                }
+                if (auto error = chunk.values.CollectNumbers(col, row_begin, row_end, numbers)) {
+                    return error;
+                }
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+std::variant<double, FormulaError> Sheet::GetNumber(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Wrong position!"s);
+    }
+    auto chunk_it = chunks_.find(ChunkIndex(pos));
+    if (chunk_it == chunks_.end()) {
+        return 0.0;
+    }
+    const Chunk& chunk = *chunk_it->second;
+    const std::size_t index = ValueCache::Index(pos);
+    if (chunk.values.IsStale(index)) {
+        chunk.cells[CellIndex(pos)].GetValueView();
+    }
+    switch (chunk.values.GetTag(index)) {
+    case ValueCache::Tag::Empty:
+        return 0.0;
+    case ValueCache::Tag::Number:
+        return chunk.values.GetNumber(index);
+    default:
+        return FormulaError(FormulaError::Category::Value);
+    }
+}
+
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Wrong position!"s);
     }
-    if (pos < Position{ size_.rows, size_.cols }) {
-        if (!sheet_[pos.row][pos.col].IsEmpty()) {
-            sheet_[pos.row][pos.col].Clear();
-            CutSheet();
+    auto chunk_it = chunks_.find(ChunkIndex(pos));
+    if (chunk_it == chunks_.end()) {
+        return;
+    }
+    Cell& cell = chunk_it->second->cells[CellIndex(pos)];
+    if (!cell.IsEmpty()) {
+        cell.Clear();
+        cell.AttachCache(chunk_it->second->values, ValueCache::Index(pos));
+        graph_.SetReferences(pos, {});
+        if (--chunk_it->second->non_empty_count == 0) {
+            chunks_.erase(chunk_it);
         }
+        RemoveFromPrintableArea(pos);
+        InvalidateCache({ pos });
     }
 }
 
@@ -66,93 +233,502 @@ Size Sheet::GetPrintableSize() const {
     return size_;
 }
 
+namespace {
+    constexpr std::size_t OUTPUT_BUFFER_SIZE = 1 << 16;
+
+    // Настройки потока, при которых числа выводятся как std::to_chars в
+    // формате general с точностью 6, а текст - без выравнивания.
+    bool HasDefaultFormat(const std::ostream& output) {
+        constexpr auto FORMAT_FLAGS = std::ios_base::floatfield | std::ios_base::showpoint
+            | std::ios_base::showpos | std::ios_base::uppercase;
+        return (output.flags() & FORMAT_FLAGS) == 0 && output.precision() == 6
+            && output.width() == 0 && output.getloc() == std::locale::classic();
+    }
+
+    void AppendNumber(std::string& output, double number) {
+        char chars[32];
+        const auto result = std::to_chars(std::begin(chars), std::end(chars), number,
+            std::chars_format::general, 6);
+        output.append(chars, result.ptr);
+    }
+}  // namespace
+
 void Sheet::PrintValues(std::ostream& output) const {
-    for (const auto& row : sheet_) {
-        bool first_col = true;
-        for (const auto& col : row) {
-            if (!first_col) {
-                output << '\t';
+    if (!HasDefaultFormat(output)) {
+        PrintCells(output, [&output](const Cell& cell) {
+            std::visit([&output](auto value) {
+                output << value;
+            }, cell.GetValueView());
+        });
+        return;
+    }
+    StreamSink sink(output);
+    PrintValues(sink);
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    if (!HasDefaultFormat(output)) {
+        PrintCells(output, [&output](const Cell& cell) {
+            output << cell.GetText();
+        });
+        return;
+    }
+    StreamSink sink(output);
+    PrintTexts(sink);
+}
+
+void Sheet::PrintValues(OutputSink& output) const {
+    WriteCells(output, [](const Cell& cell, std::string& buffer) {
+        const Cell::ValueView value = cell.GetValueView();
+        if (const auto* number = std::get_if<double>(&value)) {
+            AppendNumber(buffer, *number);
+        }
+        else if (const auto* text = std::get_if<std::string_view>(&value)) {
+            buffer += *text;
+        }
+        else {
+            buffer += std::get<FormulaError>(value).ToString();
+        }
+    });
+}
+
+void Sheet::PrintTexts(OutputSink& output) const {
+    WriteCells(output, [](const Cell& cell, std::string& buffer) {
+        cell.AppendText(buffer);
+    });
+}
+
+namespace {
+    // Снимок начинается с заголовка, за которым идут непустые ячейки по
+    // строкам, слева направо. Ячейка - это позиция и вид ячейки; у текста
+    // далее длина и сам текст, у формулы - вид сохранённого значения
+    // (NO_VALUE, если значение не сохранено), само значение и дерево формулы.
+    constexpr char SNAPSHOT_MAGIC[] = { 'S', 'H', 'T', 'S' };
+    constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+    // Читается как другое число, если снимок записан с другим порядком байтов.
+    constexpr std::uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+    constexpr std::uint8_t NO_VALUE = 0xFF;
+
+    enum class SnapshotCell : std::uint8_t {
+        Text,
+        Formula,
+    };
+
+    template <typename T>
+    void AppendValue(std::string& output, const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        output.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    T ReadValue(std::string_view& data) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (data.size() < sizeof(T)) {
+            throw SnapshotException("Snapshot is truncated");
+        }
+        T value;
+        std::memcpy(&value, data.data(), sizeof(T));
+        data.remove_prefix(sizeof(T));
+        return value;
+    }
+
+    bool IsFormulaValue(ValueCache::Tag tag) {
+        return tag == ValueCache::Tag::Number || tag == ValueCache::Tag::RefError
+            || tag == ValueCache::Tag::ValueError || tag == ValueCache::Tag::Div0Error;
+    }
+}  // namespace
+
+void Sheet::SaveSnapshot(OutputSink& output, bool with_values) const {
+    std::string buffer;
+    buffer.reserve(OUTPUT_BUFFER_SIZE);
+    buffer.append(std::begin(SNAPSHOT_MAGIC), std::end(SNAPSHOT_MAGIC));
+    AppendValue(buffer, SNAPSHOT_VERSION);
+    AppendValue(buffer, SNAPSHOT_BYTE_ORDER);
+    std::uint64_t cell_count = 0;
+    for (const auto& [index, chunk] : chunks_) {
+        cell_count += chunk->non_empty_count;
+    }
+    AppendValue(buffer, cell_count);
+
+    std::vector<const Chunk*> row_chunks((size_.cols + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    for (int row = 0; row < size_.rows; ++row) {
+        if (row % CHUNK_SIZE == 0) {
+            for (std::size_t i = 0; i < row_chunks.size(); ++i) {
+                auto chunk_it = chunks_.find(ChunkIndex({ row, static_cast<int>(i) * CHUNK_SIZE }));
+                row_chunks[i] = chunk_it != chunks_.end() ? chunk_it->second.get() : nullptr;
             }
-            Cell::Value value = col.GetValue();
-            if (std::holds_alternative<double>(value)) {
-                output << std::get<double>(value);
+        }
+        for (int chunk_left = 0; chunk_left < size_.cols; chunk_left += CHUNK_SIZE) {
+            const Chunk* chunk = row_chunks[chunk_left / CHUNK_SIZE];
+            if (chunk == nullptr) {
+                continue;
             }
-            if (std::holds_alternative<std::string>(value)) {
-                output << std::get<std::string>(value);
+            const int chunk_right = std::min(chunk_left + CHUNK_SIZE, size_.cols);
+            for (int col = chunk_left; col < chunk_right; ++col) {
+                const Position pos{ row, col };
+                const Cell& cell = chunk->cells[CellIndex(pos)];
+                if (cell.IsEmpty()) {
+                    continue;
+                }
+                AppendValue(buffer, pos);
+                if (const FormulaInterface* formula = cell.GetFormula()) {
+                    AppendValue(buffer, SnapshotCell::Formula);
+                    const std::size_t index = ValueCache::Index(pos);
+                    if (with_values && !chunk->values.IsStale(index)) {
+                        AppendValue(buffer, chunk->values.GetTag(index));
+                        AppendValue(buffer, chunk->values.GetNumber(index));
+                    }
+                    else {
+                        AppendValue(buffer, NO_VALUE);
+                    }
+                    formula->Save(buffer);
+                }
+                else {
+                    AppendValue(buffer, SnapshotCell::Text);
+                    const std::size_t size_offset = buffer.size();
+                    AppendValue(buffer, std::uint32_t{ 0 });
+                    cell.AppendText(buffer);
+                    const auto size = static_cast<std::uint32_t>(buffer.size() - size_offset - sizeof(std::uint32_t));
+                    std::memcpy(buffer.data() + size_offset, &size, sizeof(size));
+                }
             }
-            if (std::holds_alternative<FormulaError>(value)) {
-                output << std::get<FormulaError>(value);
+            if (buffer.size() >= OUTPUT_BUFFER_SIZE) {
+                output.Write(buffer);
+                buffer.clear();
             }
-            first_col = false;
         }
-        output << '\n';
     }
+    output.Write(buffer);
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    for (const auto& row : sheet_) {
-        bool first_col = true;
-        for (const auto& col : row) {
-            if (!first_col) {
-                output << '\t';
+void Sheet::LoadSnapshot(std::string_view data) {
+    assert(chunks_.empty());
+    const std::string_view magic(SNAPSHOT_MAGIC, std::size(SNAPSHOT_MAGIC));
+    if (data.substr(0, magic.size()) != magic) {
+        throw SnapshotException("Not a sheet snapshot");
+    }
+    data.remove_prefix(magic.size());
+    if (ReadValue<std::uint32_t>(data) != SNAPSHOT_VERSION) {
+        throw SnapshotException("Unsupported snapshot version");
+    }
+    if (ReadValue<std::uint32_t>(data) != SNAPSHOT_BYTE_ORDER) {
+        throw SnapshotException("Snapshot byte order differs from the platform one");
+    }
+    const auto cell_count = ReadValue<std::uint64_t>(data);
+
+    std::vector<std::pair<Position, Cell>> cells;
+    // Сохранённые значения формул записываются в кэш после размещения ячеек.
+    std::vector<std::tuple<Position, ValueCache::Tag, double>> values;
+    // Повреждённый счётчик не должен приводить к огромному резервированию.
+    cells.reserve(std::min<std::uint64_t>(cell_count, data.size() / (sizeof(Position) + 1)));
+    std::optional<Position> previous;
+    for (std::uint64_t i = 0; i < cell_count; ++i) {
+        const auto pos = ReadValue<Position>(data);
+        // Ячейки упорядочены строго по возрастанию, поэтому повторов нет.
+        if (!pos.IsValid() || (previous && !(*previous < pos))) {
+            throw SnapshotException("Invalid cell position in the snapshot");
+        }
+        previous = pos;
+
+        Cell cell;
+        switch (ReadValue<SnapshotCell>(data)) {
+        case SnapshotCell::Text: {
+            const auto size = ReadValue<std::uint32_t>(data);
+            if (size == 0 || size > data.size()
+                || (data.front() == FORMULA_SIGN && size > 1)) {
+                throw SnapshotException("Invalid cell text in the snapshot");
             }
-            output << col.GetText();
-            first_col = false;
+            cell.Set(data.substr(0, size), pos, formulas_, *this);
+            data.remove_prefix(size);
+            break;
         }
-        output << '\n';
+        case SnapshotCell::Formula: {
+            const auto tag = ReadValue<std::uint8_t>(data);
+            if (tag != NO_VALUE) {
+                const auto value_tag = static_cast<ValueCache::Tag>(tag);
+                if (!IsFormulaValue(value_tag)) {
+                    throw SnapshotException("Invalid formula value in the snapshot");
+                }
+                values.emplace_back(pos, value_tag, ReadValue<double>(data));
+            }
+            try {
+                cell.SetFormula(LoadFormula(data), *this);
+            }
+            catch (const FormulaException& error) {
+                throw SnapshotException(error.what());
+            }
+            break;
+        }
+        default:
+            throw SnapshotException("Invalid cell kind in the snapshot");
+        }
+        cells.emplace_back(pos, std::move(cell));
+    }
+    if (!data.empty()) {
+        throw SnapshotException("Unexpected data after the snapshot");
+    }
+
+    // В отличие от ApplyCells() таблица пуста: в граф попадают только ячейки
+    // со ссылками, а кэш сбрасывать не у кого.
+    DependencyGraph::References references;
+    for (const auto& [pos, cell] : cells) {
+        const auto& referenced_cells = cell.GetReferencedCells();
+        const auto& referenced_ranges = cell.GetReferencedRanges();
+        if (referenced_cells.empty() && referenced_ranges.empty()) {
+            continue;
+        }
+        references.indices.emplace(pos, references.positions.size());
+        references.positions.push_back(pos);
+        references.referenced_cells.push_back(referenced_cells);
+        references.referenced_ranges.push_back(referenced_ranges);
+    }
+    if (!graph_.TrySetReferences(std::move(references))) {
+        throw SnapshotException("Circular dependency in the snapshot");
+    }
+
+    // Формулы без сохранённых значений остаются устаревшими до пересчёта.
+    for (auto& [pos, cell] : cells) {
+        if (cell.GetFormula() != nullptr) {
+            dirty_cells_.insert(pos);
+        }
+        PlaceCell(pos, std::move(cell));
+    }
+    for (const auto& [pos, tag, number] : values) {
+        chunks_.at(ChunkIndex(pos))->values.Store(ValueCache::Index(pos), tag, number);
+        dirty_cells_.erase(pos);
     }
 }
 
-void Sheet::DeleteRow(int row) {
-    sheet_.erase(sheet_.begin() + row);
-    --size_.rows;
+void Sheet::Recalculate() {
+    std::vector<Position> stale_cells;
+    std::unordered_map<Position, std::size_t, PositionHasher> stale_indices;
+    for (const auto& pos : dirty_cells_) {
+        const Cell* cell = FindCell(pos);
+        if (cell && !cell->HasCach()) {
+            stale_indices.emplace(pos, stale_cells.size());
+            stale_cells.push_back(pos);
+        }
+    }
+    dirty_cells_.clear();
+
+    // Формула вычисляется, когда все её устаревшие аргументы уже в кэше,
+    // поэтому вычисление не уходит в рекурсию.
+    TaskGraph tasks;
+    tasks.pending_inputs.resize(stale_cells.size());
+    tasks.dependents_begin.reserve(stale_cells.size() + 1);
+    tasks.dependents_begin.push_back(0);
+    for (const auto& pos : stale_cells) {
+        graph_.ForEachDependent(pos, [&](Position dependent_pos) {
+            auto index_it = stale_indices.find(dependent_pos);
+            if (index_it != stale_indices.end()) {
+                tasks.dependents.push_back(index_it->second);
+                ++tasks.pending_inputs[index_it->second];
+            }
+        });
+        tasks.dependents_begin.push_back(tasks.dependents.size());
+    }
+
+    RunTaskGraph(tasks, [this, &stale_cells](std::size_t index) {
+        FindCell(stale_cells[index])->GetValueView();
+    }, recalculation_threads_);
+}
+
+void Sheet::SetRecalculationThreads(std::size_t thread_count) {
+    recalculation_threads_ = std::max<std::size_t>(thread_count, 1);
+}
+
+int Sheet::ChunkIndex(Position pos) {
+    return pos.row / CHUNK_SIZE * CHUNKS_PER_ROW + pos.col / CHUNK_SIZE;
+}
+
+int Sheet::CellIndex(Position pos) {
+    return pos.row % CHUNK_SIZE * CHUNK_SIZE + pos.col % CHUNK_SIZE;
 }
 
-void Sheet::DeleteCol(int col) {
-    for (auto& row : sheet_) {
-        row.erase(row.begin() + col);
+Cell* Sheet::FindCell(Position pos) {
+    auto chunk_it = chunks_.find(ChunkIndex(pos));
+    if (chunk_it == chunks_.end()) {
+        return nullptr;
     }
-    --size_.cols;
+    return &chunk_it->second->cells[CellIndex(pos)];
 }
 
-bool Sheet::RowIsEmpty(int row) const {
-    for (const auto& it : sheet_[row]) {
-        if (!it.IsEmpty()) {
-            return false;
+const Cell* Sheet::FindCell(Position pos) const {
+    return const_cast<Sheet*>(this)->FindCell(pos);
+}
+
+void Sheet::PlaceCell(Position pos, Cell cell) {
+    // Блок существует, только пока в нём есть непустые ячейки: пустая ячейка
+    // не создаёт блок, а блок без непустых ячеек удаляется, как в ClearCell.
+    if (cell.IsEmpty()) {
+        auto chunk_it = chunks_.find(ChunkIndex(pos));
+        if (chunk_it == chunks_.end()) {
+            return;
+        }
+        Cell& target = chunk_it->second->cells[CellIndex(pos)];
+        if (target.IsEmpty()) {
+            return;
         }
+        target = std::move(cell);
+        target.AttachCache(chunk_it->second->values, ValueCache::Index(pos));
+        if (--chunk_it->second->non_empty_count == 0) {
+            chunks_.erase(chunk_it);
+        }
+        RemoveFromPrintableArea(pos);
+        return;
+    }
+    Chunk& chunk = GetOrCreateChunk(pos);
+    Cell& target = chunk.cells[CellIndex(pos)];
+    if (target.IsEmpty()) {
+        ++chunk.non_empty_count;
+        AddToPrintableArea(pos);
     }
-    return true;
+    target = std::move(cell);
+    target.AttachCache(chunk.values, ValueCache::Index(pos));
+}
+
+void Sheet::AddToPrintableArea(Position pos) {
+    row_counts_.Increment(pos.row);
+    col_counts_.Increment(pos.col);
+    size_.rows = std::max(size_.rows, pos.row + 1);
+    size_.cols = std::max(size_.cols, pos.col + 1);
+}
+
+void Sheet::RemoveFromPrintableArea(Position pos) {
+    row_counts_.Decrement(pos.row);
+    col_counts_.Decrement(pos.col);
+    size_ = { row_counts_.GetEnd(), col_counts_.GetEnd() };
 }
 
-bool Sheet::ColIsEmpty(int col) const {
-    for (const auto& row : sheet_) {
-        if (!row[col].IsEmpty()) {
-            return false;
+void Sheet::ApplyCells(std::vector<std::pair<Position, Cell>> cells) {
+    // Ячейка без ссылок, которая не заменяет формулу со ссылками, не меняет
+    // граф и не может замкнуть цикл, поэтому в проверку попадают только
+    // остальные ячейки. Обычно это лишь малая часть загружаемых данных.
+    DependencyGraph::References new_references;
+    for (const auto& [pos, cell] : cells) {
+        const auto& referenced_cells = cell.GetReferencedCells();
+        const auto& referenced_ranges = cell.GetReferencedRanges();
+        if (referenced_cells.empty() && referenced_ranges.empty()
+            && graph_.GetReferences(pos).empty() && graph_.GetReferencedRanges(pos).empty()) {
+            continue;
         }
+        new_references.indices.emplace(pos, new_references.positions.size());
+        new_references.positions.push_back(pos);
+        new_references.referenced_cells.push_back(referenced_cells);
+        new_references.referenced_ranges.push_back(referenced_ranges);
     }
-    return true;
+    if (!graph_.TrySetReferences(std::move(new_references))) {
+        throw CircularDependencyException("Circular Dependency!");
+    }
+
+    std::vector<Position> positions;
+    positions.reserve(cells.size());
+    for (auto& [pos, cell] : cells) {
+        positions.push_back(pos);
+        PlaceCell(pos, std::move(cell));
+    }
+    InvalidateCache(positions);
+}
+
+Sheet::Chunk& Sheet::GetOrCreateChunk(Position pos) {
+    auto& chunk = chunks_[ChunkIndex(pos)];
+    if (!chunk) {
+        chunk = std::make_unique<Chunk>();
+    }
+    return *chunk;
 }
 
-void Sheet::CutSheet() {
-    if (size_.cols > 0) {
-        for (auto col = size_.cols - 1; col >= 0; --col) {
-            if (ColIsEmpty(col)) {
-                DeleteCol(col);
+void Sheet::InvalidateCache(const std::vector<Position>& positions) {
+    // Если у зависимой ячейки кэш уже пуст, то он пуст и у всех ячеек, которые
+    // от неё зависят: формула кэширует значения всех ячеек, которые вычисляет.
+    // Поэтому обход останавливается на таких ячейках, а каждая ячейка
+    // посещается не более одного раза. Сами исходные ячейки в visited_cells
+    // не заносятся: их кэш сброшен заранее, и обход на них остановится.
+    PositionSet visited_cells;
+    std::vector<Position> stack;
+    dirty_cells_.reserve(dirty_cells_.size() + positions.size());
+    auto push_parents = [&](Position cell_pos) {
+        graph_.ForEachDependent(cell_pos, [&](Position parent_pos) {
+            if (visited_cells.insert(parent_pos).second) {
+                stack.push_back(parent_pos);
             }
-            else {
-                break;
+        });
+    };
+    for (const auto& pos : positions) {
+        if (Cell* cell = FindCell(pos)) {
+            cell->ClearCach();
+            if (!cell->HasCach()) {
+                dirty_cells_.insert(pos);
+            }
+        }
+        push_parents(pos);
+    }
+    while (!stack.empty()) {
+        const Position parent_pos = stack.back();
+        stack.pop_back();
+        Cell* parent_cell = FindCell(parent_pos);
+        if (parent_cell && parent_cell->HasCach()) {
+            parent_cell->ClearCach();
+            dirty_cells_.insert(parent_pos);
+            push_parents(parent_pos);
+        }
+    }
+}
+
+template <typename WriteCell>
+void Sheet::WriteCells(OutputSink& output, WriteCell write_cell) const {
+    std::string buffer;
+    buffer.reserve(OUTPUT_BUFFER_SIZE);
+    // Блоки текущей строки блоков, по одному на CHUNK_SIZE столбцов.
+    std::vector<const Chunk*> row_chunks((size_.cols + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    for (int row = 0; row < size_.rows; ++row) {
+        if (row % CHUNK_SIZE == 0) {
+            for (std::size_t i = 0; i < row_chunks.size(); ++i) {
+                auto chunk_it = chunks_.find(ChunkIndex({ row, static_cast<int>(i) * CHUNK_SIZE }));
+                row_chunks[i] = chunk_it != chunks_.end() ? chunk_it->second.get() : nullptr;
             }
         }
+        for (int chunk_left = 0; chunk_left < size_.cols; chunk_left += CHUNK_SIZE) {
+            const int chunk_right = std::min(chunk_left + CHUNK_SIZE, size_.cols);
+            const Chunk* chunk = row_chunks[chunk_left / CHUNK_SIZE];
+            if (chunk == nullptr) {
+                // Табуляция выводится перед каждым столбцом, кроме первого.
+                buffer.append(chunk_right - chunk_left - (chunk_left == 0 ? 1 : 0), '\t');
+                continue;
+            }
+            for (int col = chunk_left; col < chunk_right; ++col) {
+                if (col > 0) {
+                    buffer += '\t';
+                }
+                const Cell& cell = chunk->cells[CellIndex({ row, col })];
+                if (!cell.IsEmpty()) {
+                    write_cell(cell, buffer);
+                }
+            }
+            if (buffer.size() >= OUTPUT_BUFFER_SIZE) {
+                output.Write(buffer);
+                buffer.clear();
+            }
+        }
+        buffer += '\n';
+    }
+    if (!buffer.empty()) {
+        output.Write(buffer);
     }
-    if (size_.rows > 0) {
-        for (auto row = size_.rows - 1; row >= 0; --row) {
-            if (RowIsEmpty(row)) {
-                DeleteRow(row);
+}
+
+void Sheet::PrintCells(std::ostream& output,
+    const std::function<void(const Cell&)>& print_cell) const {
+    for (int row = 0; row < size_.rows; ++row) {
+        for (int col = 0; col < size_.cols; ++col) {
+            if (col > 0) {
+                output << '\t';
             }
-            else {
-                break;
+            if (const Cell* cell = FindCell({ row, col })) {
+                print_cell(*cell);
             }
         }
+        output << '\n';
     }
 }
 
@@ -160,3 +736,8 @@ std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
 }
 
+std::unique_ptr<SheetInterface> LoadSheetSnapshot(std::string_view data) {
+    auto sheet = std::make_unique<Sheet>();
+    sheet->LoadSnapshot(data);
+    return sheet;
+}
@@ -2,34 +2,96 @@
 
 #include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "line_counts.h"
 
+#include <array>
 #include <functional>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
 
 class Sheet : public SheetInterface {
 public:
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
+    void SetCells(std::vector<std::pair<Position, std::string>> cells) override;
+    void LoadTexts(std::istream& input, char separator) override;
 
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
+    std::optional<FormulaError> CollectNumbers(Range range,
+        std::vector<double>& numbers) const override;
+    std::variant<double, FormulaError> GetNumber(Position pos) const override;
+
     void ClearCell(Position pos) override;
 
     Size GetPrintableSize() const override;
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+    void PrintValues(OutputSink& output) const override;
+    void PrintTexts(OutputSink& output) const override;
+
+    void SaveSnapshot(OutputSink& output, bool with_values) const override;
+    // Заполняет пустую таблицу из снимка SaveSnapshot().
+    void LoadSnapshot(std::string_view data);
+
+    void Recalculate() override;
+    void SetRecalculationThreads(std::size_t thread_count) override;
 
 private:
+    // Ячейки хранятся блоками CHUNK_SIZE x CHUNK_SIZE, которые создаются только
+    // при первой записи в них, поэтому память зависит от числа заполненных
+    // областей, а не от размера таблицы. Значения ячеек блока хранятся в его
+    // кэше значений по столбцам.
+    static constexpr int CHUNK_SIZE = ValueCache::SIDE;
+    static constexpr int CHUNKS_PER_ROW = Position::MAX_COLS / CHUNK_SIZE;
+
+    struct Chunk {
+        std::array<Cell, CHUNK_SIZE * CHUNK_SIZE> cells;
+        ValueCache values;
+        int non_empty_count = 0;
+    };
+
+    // Печатная область - наименьший прямоугольник, содержащий все непустые
+    // ячейки. Она поддерживается по счётчикам непустых ячеек строк и
+    // столбцов, а не поиском пустых строк и столбцов с края таблицы.
     Size size_;
-    std::vector<std::vector<Cell>> sheet_;
+    LineCounts row_counts_;
+    LineCounts col_counts_;
+    std::unordered_map<int, std::unique_ptr<Chunk>> chunks_;
+    DependencyGraph graph_;
+    FormulaCache formulas_;
+    // Формулы, кэш которых был сброшен после последнего пересчёта.
+    PositionSet dirty_cells_;
+    std::size_t recalculation_threads_ = 1;
+
+    static int ChunkIndex(Position pos);
+    static int CellIndex(Position pos);
+
+    Cell* FindCell(Position pos);
+    const Cell* FindCell(Position pos) const;
+    Chunk& GetOrCreateChunk(Position pos);
+    void PlaceCell(Position pos, Cell cell);
+    // Записывает набор ячейки с различными позициями как одну операцию.
+    void ApplyCells(std::vector<std::pair<Position, Cell>> cells);
 
-    void DeleteRow(int row);
-    void DeleteCol(int col);
+    void InvalidateCache(const std::vector<Position>& positions);
 
-    bool RowIsEmpty(int row) const;
-    bool ColIsEmpty(int col) const;
+    // Учитывают в печатной области ячейку pos, которая становится непустой
+    // или пустой.
+    void AddToPrintableArea(Position pos);
+    void RemoveFromPrintableArea(Position pos);
 
-    void CutSheet();
+    // Выводит таблицу через буфер: write_cell(cell, buffer) дописывает в
+    // буфер непустую ячейку. Отсутствующие блоки выводятся сразу целиком.
+    template <typename WriteCell>
+    void WriteCells(OutputSink& output, WriteCell write_cell) const;
+    // Вывод в поток с изменёнными настройками форматирования: каждая
+    // ячейка выводится в поток отдельно.
+    void PrintCells(std::ostream& output,
+        const std::function<void(const Cell&)>& print_cell) const;
 };
\ No newline at end of file
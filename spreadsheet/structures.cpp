@@ -1,7 +1,7 @@
 #include "common.h"
 
 #include <cctype>
-#include <sstream>
+#include <charconv>
 #include <algorithm>
 
 const int LETTERS = 26;
@@ -59,8 +59,8 @@ Position Position::FromString(std::string_view str) {
     }
 
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    const auto [row_end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (error != std::errc() || row_end != digits.data() + digits.size()) {
         return Position::NONE;
     }
 
@@ -73,6 +73,38 @@ Position Position::FromString(std::string_view str) {
     return {row - 1, col - 1};
 }
 
+bool Range::operator==(const Range rhs) const {
+    return top_left == rhs.top_left && bottom_right == rhs.bottom_right;
+}
+
+bool Range::operator<(const Range rhs) const {
+    return std::tie(top_left, bottom_right) < std::tie(rhs.top_left, rhs.bottom_right);
+}
+
+bool Range::IsValid() const {
+    return top_left.IsValid() && bottom_right.IsValid()
+        && top_left.row <= bottom_right.row && top_left.col <= bottom_right.col;
+}
+
+bool Range::Contains(const Position pos) const {
+    return top_left.row <= pos.row && pos.row <= bottom_right.row
+        && top_left.col <= pos.col && pos.col <= bottom_right.col;
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    return top_left.ToString() + ':' + bottom_right.ToString();
+}
+
+Range Range::FromCorners(const Position first, const Position second) {
+    return {
+        {std::min(first.row, second.row), std::min(first.col, second.col)},
+        {std::max(first.row, second.row), std::max(first.col, second.col)},
+    };
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
@@ -0,0 +1,191 @@
+#include "task_graph.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace {
+    void RunSerial(const TaskGraph& graph, const std::function<void(std::size_t)>& task) {
+        std::vector<int> pending_inputs = graph.pending_inputs;
+        std::vector<std::size_t> worklist;
+        for (std::size_t i = 0; i < graph.Size(); ++i) {
+            if (pending_inputs[i] == 0) {
+                worklist.push_back(i);
+            }
+        }
+        while (!worklist.empty()) {
+            const std::size_t current = worklist.back();
+            worklist.pop_back();
+            task(current);
+            for (auto i = graph.dependents_begin[current]; i < graph.dependents_begin[current + 1]; ++i) {
+                const std::size_t dependent = graph.dependents[i];
+                if (--pending_inputs[dependent] == 0) {
+                    worklist.push_back(dependent);
+                }
+            }
+        }
+    }
+
+    class WorkStealingRunner {
+    public:
+        WorkStealingRunner(const TaskGraph& graph, const std::function<void(std::size_t)>& task,
+            std::size_t thread_count)
+            : graph_(graph)
+            , task_(task)
+            , pending_inputs_(graph.Size())
+            , queues_(thread_count)
+            , remaining_(graph.Size()) {
+            std::size_t next_queue = 0;
+            for (std::size_t i = 0; i < graph.Size(); ++i) {
+                pending_inputs_[i].store(graph.pending_inputs[i], std::memory_order_relaxed);
+                if (graph.pending_inputs[i] == 0) {
+                    queues_[next_queue].tasks.push_back(i);
+                    next_queue = (next_queue + 1) % queues_.size();
+                    queued_.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        void Run() {
+            std::vector<std::thread> threads;
+            for (std::size_t id = 1; id < queues_.size(); ++id) {
+                threads.emplace_back([this, id] {
+                    Work(id);
+                });
+            }
+            Work(0);
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            if (error_) {
+                std::rethrow_exception(error_);
+            }
+        }
+
+    private:
+        struct WorkerQueue {
+            std::mutex mutex;
+            std::deque<std::size_t> tasks;
+        };
+
+        const TaskGraph& graph_;
+        const std::function<void(std::size_t)>& task_;
+        std::vector<std::atomic<int>> pending_inputs_;
+        std::vector<WorkerQueue> queues_;
+        std::atomic<std::size_t> remaining_;
+        std::atomic<bool> failed_{ false };
+        std::mutex error_mutex_;
+        std::exception_ptr error_;
+        // Поток без задач засыпает, пока в очередях нет задач (queued_) и
+        // работа не закончена. Спящий поток сначала учитывается в sleepers_,
+        // а затем проверяет queued_, а Push наоборот, поэтому Push либо видит
+        // спящий поток и будит его, либо поток видит новую задачу.
+        std::atomic<std::size_t> queued_{ 0 };
+        std::atomic<std::size_t> sleepers_{ 0 };
+        std::mutex idle_mutex_;
+        std::condition_variable idle_;
+
+        std::optional<std::size_t> PopOwn(std::size_t id) {
+            WorkerQueue& queue = queues_[id];
+            std::lock_guard guard(queue.mutex);
+            if (queue.tasks.empty()) {
+                return std::nullopt;
+            }
+            const std::size_t current = queue.tasks.back();
+            queue.tasks.pop_back();
+            queued_.fetch_sub(1);
+            return current;
+        }
+
+        std::optional<std::size_t> Steal(std::size_t id) {
+            for (std::size_t shift = 1; shift < queues_.size(); ++shift) {
+                WorkerQueue& queue = queues_[(id + shift) % queues_.size()];
+                std::lock_guard guard(queue.mutex);
+                if (!queue.tasks.empty()) {
+                    const std::size_t current = queue.tasks.front();
+                    queue.tasks.pop_front();
+                    queued_.fetch_sub(1);
+                    return current;
+                }
+            }
+            return std::nullopt;
+        }
+
+        void Push(std::size_t id, std::size_t current) {
+            {
+                WorkerQueue& queue = queues_[id];
+                std::lock_guard guard(queue.mutex);
+                queue.tasks.push_back(current);
+                queued_.fetch_add(1);
+            }
+            if (sleepers_.load() > 0) {
+                // Захват мьютекса гарантирует, что поток, который уже решил
+                // заснуть, успел начать ожидание и получит уведомление.
+                std::lock_guard guard(idle_mutex_);
+                idle_.notify_one();
+            }
+        }
+
+        void WaitForTask() {
+            std::unique_lock lock(idle_mutex_);
+            sleepers_.fetch_add(1);
+            idle_.wait(lock, [this] {
+                return queued_.load() > 0 || remaining_.load() == 0 || failed_.load();
+            });
+            sleepers_.fetch_sub(1);
+        }
+
+        void WakeAll() {
+            std::lock_guard guard(idle_mutex_);
+            idle_.notify_all();
+        }
+
+        void Work(std::size_t id) {
+            while (remaining_.load(std::memory_order_acquire) > 0
+                && !failed_.load(std::memory_order_relaxed)) {
+                auto current = PopOwn(id);
+                if (!current) {
+                    current = Steal(id);
+                }
+                if (!current) {
+                    WaitForTask();
+                    continue;
+                }
+                try {
+                    task_(*current);
+                }
+                catch (...) {
+                    std::lock_guard guard(error_mutex_);
+                    if (!error_) {
+                        error_ = std::current_exception();
+                    }
+                    failed_.store(true);
+                    WakeAll();
+                    return;
+                }
+                for (auto i = graph_.dependents_begin[*current]; i < graph_.dependents_begin[*current + 1]; ++i) {
+                    const std::size_t dependent = graph_.dependents[i];
+                    if (pending_inputs_[dependent].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                        Push(id, dependent);
+                    }
+                }
+                if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    WakeAll();
+                }
+            }
+        }
+    };
+}  // namespace
+
+void RunTaskGraph(const TaskGraph& graph, const std::function<void(std::size_t)>& task,
+    std::size_t thread_count) {
+    if (thread_count <= 1 || graph.Size() < 2) {
+        RunSerial(graph, task);
+        return;
+    }
+    WorkStealingRunner(graph, task, thread_count).Run();
+}
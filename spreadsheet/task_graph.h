@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// Граф задач: задача готова к выполнению, когда завершены все задачи, от
+// которых она зависит. Зависимые задачи хранятся подряд в одном массиве:
+// для задачи i это dependents[dependents_begin[i] .. dependents_begin[i + 1]).
+struct TaskGraph {
+    std::vector<int> pending_inputs;
+    std::vector<std::size_t> dependents_begin;
+    std::vector<std::size_t> dependents;
+
+    std::size_t Size() const {
+        return pending_inputs.size();
+    }
+};
+
+// Выполняет все задачи графа, причём задача запускается только после всех
+// задач, от которых она зависит. При thread_count > 1 задачи распределяются
+// между потоками с перехватом работы: поток берёт задачи из конца своей
+// очереди, а когда она пуста - из начала чужих. Задача, у которой завершилась
+// последняя входная задача, попадает в очередь завершившего её потока.
+void RunTaskGraph(const TaskGraph& graph, const std::function<void(std::size_t)>& task,
+    std::size_t thread_count);
@@ -0,0 +1,152 @@
+#include "value_cache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
+#include <string>
+#include <system_error>
+
+namespace {
+    std::uint64_t RowBit(std::size_t index) {
+        return std::uint64_t{ 1 } << (index % ValueCache::SIDE);
+    }
+
+    bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    // Разбирает текст так же, как std::strtod в локали "C", но без копирования
+    // строки и без обращения к локали. Текст считается числом, только если он
+    // разобран целиком.
+    std::optional<double> ParseNumber(std::string_view text) {
+        const std::string_view original = text;
+        while (!text.empty() && IsSpace(text.front())) {
+            text.remove_prefix(1);
+        }
+        bool negative = false;
+        if (!text.empty() && (text.front() == '+' || text.front() == '-')) {
+            negative = text.front() == '-';
+            text.remove_prefix(1);
+        }
+        auto format = std::chars_format::general;
+        if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+            format = std::chars_format::hex;
+            text.remove_prefix(2);
+            // После префикса std::from_chars принял бы и "inf" с "nan".
+            if (!std::isxdigit(static_cast<unsigned char>(text.front())) && text.front() != '.') {
+                return std::nullopt;
+            }
+        }
+        // Знак уже разобран, а std::from_chars принимает ещё один минус.
+        if (!text.empty() && text.front() == '-') {
+            return std::nullopt;
+        }
+
+        double number;
+        const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number, format);
+        if (error == std::errc::invalid_argument || end != text.data() + text.size()) {
+            return std::nullopt;
+        }
+        if (error == std::errc::result_out_of_range) {
+            // Переполнение редко, и в нём strtod определяет, что вернуть.
+            return std::strtod(std::string(original).c_str(), nullptr);
+        }
+        return negative ? -number : number;
+    }
+}
+
+FormulaError ValueCache::GetError(std::size_t index) const {
+    switch (tags_[index]) {
+    case Tag::RefError:
+        return FormulaError::Category::Ref;
+    case Tag::Div0Error:
+        return FormulaError::Category::Div0;
+    default:
+        assert(tags_[index] == Tag::ValueError);
+        return FormulaError::Category::Value;
+    }
+}
+
+void ValueCache::StoreEmpty(std::size_t index) {
+    Store(index, Tag::Empty, 0.0);
+}
+
+void ValueCache::StoreText(std::size_t index, std::string_view value) {
+    if (value.empty()) {
+        Store(index, Tag::Empty, 0.0);
+        return;
+    }
+    if (const auto number = ParseNumber(value)) {
+        Store(index, Tag::Number, *number);
+    }
+    else {
+        Store(index, Tag::Text, 0.0);
+    }
+}
+
+void ValueCache::StoreNumber(std::size_t index, double number) {
+    Store(index, Tag::Number, number);
+}
+
+void ValueCache::StoreError(std::size_t index, FormulaError error) {
+    switch (error.GetCategory()) {
+    case FormulaError::Category::Ref:
+        Store(index, Tag::RefError, 0.0);
+        break;
+    case FormulaError::Category::Value:
+        Store(index, Tag::ValueError, 0.0);
+        break;
+    case FormulaError::Category::Div0:
+        Store(index, Tag::Div0Error, 0.0);
+        break;
+    }
+}
+
+std::uint64_t ValueCache::RowMask(int row_begin, int row_end) {
+    const std::uint64_t up_to_end = row_end == SIDE ? ~std::uint64_t{ 0 } : (std::uint64_t{ 1 } << row_end) - 1;
+    return up_to_end & ~((std::uint64_t{ 1 } << row_begin) - 1);
+}
+
+bool ValueCache::IsStale(std::size_t index) const {
+    return (GetStaleRows(static_cast<int>(index / SIDE)) & RowBit(index)) != 0;
+}
+
+void ValueCache::MarkStale(std::size_t index) {
+    stale_[index / SIDE].fetch_or(RowBit(index), std::memory_order_relaxed);
+}
+
+std::optional<FormulaError> ValueCache::CollectNumbers(int col, int row_begin, int row_end,
+    std::vector<double>& numbers) const {
+    const std::size_t begin = static_cast<std::size_t>(col) * SIDE + row_begin;
+    const std::size_t end = static_cast<std::size_t>(col) * SIDE + row_end;
+    assert((GetStaleRows(col) & RowMask(row_begin, row_end)) == 0);
+
+    // Обычно отрезок столбца целиком состоит из чисел, и его можно скопировать
+    // одним блоком.
+    const auto tags_begin = tags_.begin() + begin;
+    const auto tags_end = tags_.begin() + end;
+    if (std::all_of(tags_begin, tags_end, [](Tag tag) { return tag == Tag::Number; })) {
+        numbers.insert(numbers.end(), numbers_.begin() + begin, numbers_.begin() + end);
+        return std::nullopt;
+    }
+    for (std::size_t index = begin; index < end; ++index) {
+        switch (tags_[index]) {
+        case Tag::Empty:
+            break;
+        case Tag::Number:
+            numbers.push_back(numbers_[index]);
+            break;
+        default:
+            return FormulaError(FormulaError::Category::Value);
+        }
+    }
+    return std::nullopt;
+}
+
+void ValueCache::Store(std::size_t index, Tag tag, double number) {
+    numbers_[index] = number;
+    tags_[index] = tag;
+    stale_[index / SIDE].fetch_and(~RowBit(index), std::memory_order_release);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Кэш значений одного блока таблицы SIDE x SIDE, хранящийся как структура
+// массивов: числовые значения лежат в плотном массиве double, вид значения -
+// в массиве тегов, а устаревшие значения формул отмечены битовой маской.
+// Внутри блока значения расположены по столбцам, поэтому значения отрезка
+// столбца лежат в памяти подряд.
+//
+// Строки в кэше не хранятся: текст остаётся в ячейке, а в кэш записывается
+// только его числовое представление.
+class ValueCache {
+public:
+    static constexpr int SIDE = 64;
+    static constexpr std::size_t SIZE = SIDE * SIDE;
+
+    // Вид значения ячейки с точки зрения формулы, которая на неё ссылается.
+    enum class Tag : std::uint8_t {
+        Empty,      // пустая ячейка или пустой текст
+        Number,     // число или текст, который трактуется как число
+        Text,       // текст, который нельзя трактовать как число
+        RefError,
+        ValueError,
+        Div0Error,
+    };
+
+    static std::size_t Index(Position pos) {
+        return static_cast<std::size_t>(pos.col % SIDE) * SIDE + pos.row % SIDE;
+    }
+
+    Tag GetTag(std::size_t index) const {
+        return tags_[index];
+    }
+    double GetNumber(std::size_t index) const {
+        return numbers_[index];
+    }
+    FormulaError GetError(std::size_t index) const;
+
+    void StoreEmpty(std::size_t index);
+    // Записывает числовое представление видимого значения текстовой ячейки.
+    // Текст разбирается один раз, при записи.
+    void StoreText(std::size_t index, std::string_view value);
+    void StoreNumber(std::size_t index, double number);
+    void StoreError(std::size_t index, FormulaError error);
+    // Записывает значение вместе с его видом, например восстановленное из
+    // снимка таблицы.
+    void Store(std::size_t index, Tag tag, double number);
+
+    // Значение формулы устарело и должно быть вычислено заново.
+    bool IsStale(std::size_t index) const;
+    void MarkStale(std::size_t index);
+
+    // Маска строк блока [row_begin, row_end).
+    static std::uint64_t RowMask(int row_begin, int row_end);
+
+    // Возвращает маску строк столбца col блока, значения которых устарели.
+    std::uint64_t GetStaleRows(int col) const {
+        return stale_[col].load(std::memory_order_acquire);
+    }
+
+    // Дописывает в numbers числовые значения ячеек столбца col блока в
+    // строках [row_begin, row_end), пропуская пустые. Устаревших значений в
+    // отрезке быть не должно. Если значение какой-то ячейки нельзя трактовать
+    // как число, возвращает ошибку #VALUE!.
+    std::optional<FormulaError> CollectNumbers(int col, int row_begin, int row_end,
+        std::vector<double>& numbers) const;
+
+private:
+    static_assert(SIDE == 64, "a column of the block must fit into one mask word");
+
+    std::array<double, SIZE> numbers_{};
+    std::array<Tag, SIZE> tags_{};
+    // Ячейки блока вычисляются параллельно при пересчёте, а одно слово маски
+    // общее для всего столбца, поэтому маска атомарна.
+    std::array<std::atomic<std::uint64_t>, SIDE> stale_{};
+};